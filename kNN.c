@@ -6,6 +6,11 @@
 
 #include <math.h>
 
+/* Search counters are compiled out with -DKNN_NO_STATS or -DNDEBUG */
+#if defined(NDEBUG) && !defined(KNN_NO_STATS)
+#define KNN_NO_STATS
+#endif
+
 /* Structure definitions */
 
 typedef struct node node_t;
@@ -20,6 +25,24 @@ typedef struct {
     node_t *root;
 } tree_t;
 
+/* Cost of the searches, every field is a total and a worst single query */
+typedef struct {
+    size_t queries;
+    size_t visited,   max_visited;    /* nodes looked at */
+    size_t distances, max_distances;  /* calls to distance() */
+    size_t pruned,    max_pruned;     /* subtrees skipped */
+    size_t results,   max_results;
+} search_stats_t;
+
+/* Shape of the tree, as built by point_insert() */
+typedef struct {
+    size_t nodes;
+    size_t depth;          /* nodes on the longest path from the root */
+    size_t depth_sum;      /* to average the depth of the nodes */
+    long   root_balance;   /* height(left) - height(right) of the root */
+    long   max_imbalance;  /* largest |height(left) - height(right)| */
+} tree_shape_t;
+
 /* Internal node functions */
 
 node_t *node_create(const long *arr, const size_t arr_size);
@@ -50,6 +73,16 @@ tree_t *tree_load_from_file(const char *filename);
 
 node_t **tree_nearest_neighbour(const tree_t *tree, const long *arr);
 
+/* Statistics */
+
+void search_stats_begin(void);
+void search_stats_end(search_stats_t *stats, size_t results);
+void search_stats_print(const char *name, const search_stats_t *stats);
+
+size_t tree_shape_helper(const node_t *node, size_t level,
+                         tree_shape_t *shape);
+void tree_stats_print(const tree_t *tree);
+
 /* Misc functions */
 
 size_t parse_line(char *line, char **words);
@@ -66,6 +99,102 @@ void dbg_tree_print(const tree_t *tree);
 
 /* Implementations */
 
+#ifndef KNN_NO_STATS
+search_stats_t nn_stats;   /* NN queries */
+search_stats_t rs_stats;   /* RS queries */
+search_stats_t query;      /* counters of the running query */
+
+#define STATS_INC(counter) (query.counter++)
+#define STATS_BEGIN()      search_stats_begin()
+#define STATS_END(stats, results) search_stats_end(&(stats), (results))
+
+void search_stats_begin(void)
+{
+    memset(&query, 0, sizeof(query));
+}
+
+void search_stats_end(search_stats_t *stats, size_t results)
+{
+    stats->queries++;
+    stats->visited   += query.visited;
+    stats->distances += query.distances;
+    stats->pruned    += query.pruned;
+    stats->results   += results;
+
+    if (query.visited > stats->max_visited)
+        stats->max_visited = query.visited;
+    if (query.distances > stats->max_distances)
+        stats->max_distances = query.distances;
+    if (query.pruned > stats->max_pruned)
+        stats->max_pruned = query.pruned;
+    if (results > stats->max_results)
+        stats->max_results = results;
+}
+
+void search_stats_print(const char *name, const search_stats_t *stats)
+{
+    printf("%s queries %zu visited %zu max %zu distances %zu max %zu "
+           "pruned %zu max %zu results %zu max %zu\n",
+           name, stats->queries, stats->visited, stats->max_visited,
+           stats->distances, stats->max_distances,
+           stats->pruned, stats->max_pruned,
+           stats->results, stats->max_results);
+}
+#else
+#define STATS_INC(counter)        ((void) 0)
+#define STATS_BEGIN()             ((void) 0)
+#define STATS_END(stats, results) ((void) 0)
+#endif
+
+size_t tree_shape_helper(const node_t *node, size_t level,
+                         tree_shape_t *shape)
+{
+    if (!node)
+        return 0;
+
+    shape->nodes++;
+    shape->depth_sum += level;
+
+    size_t left  = tree_shape_helper(node->left,  level + 1, shape);
+    size_t right = tree_shape_helper(node->right, level + 1, shape);
+    long balance = (long) left - (long) right;
+
+    if (labs(balance) > shape->max_imbalance)
+        shape->max_imbalance = labs(balance);
+    if (level == 1)
+        shape->root_balance = balance;
+
+    return 1 + (left > right ? left : right);
+}
+
+void tree_stats_print(const tree_t *tree)
+{
+    tree_shape_t shape = { 0 };
+    size_t dim = tree ? tree->dim : 0;
+
+    if (tree)
+        shape.depth = tree_shape_helper(tree->root, 1, &shape);
+
+    // A balanced tree of n nodes is floor(log2(n)) + 1 deep
+    size_t ideal = 0;
+    while (shape.nodes >> ideal)
+        ideal++;
+
+    size_t memory = (tree ? sizeof(*tree) : 0) +
+                    shape.nodes * (sizeof(node_t) + dim * sizeof(long));
+
+    printf("tree nodes %zu depth %zu ideal_depth %zu avg_depth %.2f "
+           "root_balance %ld max_imbalance %ld memory_bytes %zu\n",
+           shape.nodes, shape.depth, ideal,
+           shape.nodes ? (double) shape.depth_sum / shape.nodes : 0.0,
+           shape.root_balance, shape.max_imbalance, memory);
+
+#ifndef KNN_NO_STATS
+    search_stats_print("NN", &nn_stats);
+    search_stats_print("RS", &rs_stats);
+#endif
+}
+
 void dbg_tree_print_helper(const node_t *root, const size_t size)
 {
     if (!root)
@@ -330,6 +459,9 @@ void tree_nearest_neighbour_helper(const tree_t *tree,
     if (node == NULL)
         return;
 
+    STATS_INC(visited);
+    STATS_INC(distances);
+
     double dist = distance(node->arr, target, tree->dim);
     double diff = dist - *best_dist;
     if(fabs(diff) < 0.001) {
@@ -375,8 +507,11 @@ node_t **tree_nearest_neighbour(const tree_t *tree, const long *target) {
 
     best_nodes[0]      = tree->root;
 
+    STATS_BEGIN();
+    STATS_INC(distances);  // best_dist of the root
     tree_nearest_neighbour_helper(
         tree, tree->root, target, &best_dist, best_nodes, &best_nmemb);
+    STATS_END(nn_stats, best_nmemb);
     sort_vec(best_nodes, best_nmemb);
     for (size_t i = 0; i < best_nmemb; ++i) {
         arr_print_data(best_nodes[i]->arr, tree->dim);
@@ -397,6 +532,10 @@ int is_node(const node_t *node, node_t **result, size_t count) {
 void tree_range_search_helper(const tree_t * tree, const node_t *node, const long *range, size_t dim, int axis, node_t **result, size_t *count) {
     if (node == NULL)
         return;
+
+    // The same node comes back once per dimension
+    if (dim == 0)
+        STATS_INC(visited);
     
     if (node->arr[dim] >= range[axis] && node->arr[dim] <= range[axis + 1]) {
         // Check if the node is within the range in the current dimension
@@ -425,8 +564,10 @@ node_t **tree_range_search(const tree_t *tree, const long *range,
     node_t **result = (node_t **)malloc(sizeof(node_t *) * max_nodes);
     *result_count = 0;
 
+    STATS_BEGIN();
     tree_range_search_helper(tree, tree->root, range, 0, 0, result,
                  result_count);
+    STATS_END(rs_stats, *result_count);
     sort_vec(result, *result_count);
     for (size_t i = 0; i < *result_count; ++i)
         arr_print_data(result[i]->arr, tree->dim);
@@ -493,7 +634,8 @@ int main(void)
             } else {
                 free(nodes);
             }
-        } else if (wcount == tree->dim * 2 + 1 && !strcmp(words[0], "RS")){
+        } else if (tree && wcount == tree->dim * 2 + 1 &&
+                   !strcmp(words[0], "RS")) {
             long arr_aux[tree->dim * 2];
             node_t **nodes = NULL;
             size_t *count_nodes = calloc(1, sizeof(*count_nodes));
@@ -512,6 +654,8 @@ int main(void)
             }
         } else if (wcount == 1 && tree && !strcmp(words[0], "DEBUG")) {
                 dbg_tree_print(tree);
+        } else if (wcount == 1 && !strcmp(words[0], "STATS")) {
+            tree_stats_print(tree);
         } else {
             fprintf(stderr,
                     "Warning: Invalid command <%s>, try again!\n",
@@ -1,417 +1,3178 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
-#define ALPHABET_SIZE 26
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+/* the letters of the words, picked when building with -DMK_ALPHABET=n:
+ * 26 (a-z, the default), 36 (a-z and digits), 64 (both cases, digits, '-'
+ * and '\'') or 256 (any byte). The nodes of the tries are laid out for it */
+#ifndef MK_ALPHABET
+#define MK_ALPHABET 26
+#endif
+#if MK_ALPHABET == 26
 #define ALPHABET "abcdefghijklmnopqrstuvwxyz"
-typedef struct val val;
-struct val {
-	int no_letters;
-	char *cuv;
+#elif MK_ALPHABET == 36
+#define ALPHABET "abcdefghijklmnopqrstuvwxyz0123456789"
+#elif MK_ALPHABET == 64
+#define ALPHABET \
+	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-'"
+#elif MK_ALPHABET == 256
+#define ALPHABET NULL /* every byte is its own letter */
+#else
+#error "MK_ALPHABET must be 26, 36, 64 or 256"
+#endif
+#define ALPHABET_SIZE MK_ALPHABET
+/*output buffer*/
+// the answers are appended to a buffer instead of being printed, so that
+// the same commands can answer on stdout or on a socket
+typedef struct out_t out_t;
+struct out_t {
+	char *data;
+	size_t len;
+	size_t capacity;
 };
 
-void free_val(void *aux)
+void out_reserve(out_t *out, size_t n)
 {
-	if (!aux)
+	if (out->len + n <= out->capacity)
 		return;
-	val *value = (val *)aux;
-	free(value->cuv);
-	value->cuv = NULL;
-	free(value);
+	size_t capacity = out->capacity ? out->capacity : 4096;
+	while (capacity < out->len + n)
+		capacity *= 2;
+	out->data = realloc(out->data, capacity);
+	out->capacity = capacity;
 }
 
-/*Trie lab11*/
-typedef struct trie_node_t trie_node_t;
+void out_printf(out_t *out, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	out_reserve(out, n + 1);
+	va_start(args, format);
+	vsnprintf(out->data + out->len, n + 1, format, args);
+	va_end(args);
+	out->len += n;
+}
 
-struct trie_node_t {
-	/* Value associated with key (set if end_of_word = 1) */
-	void *value;
-	/*frequency of the word*/
-	int freq;
-	/* 1 if current node marks the end of a word, 0 otherwise */
-	int end_of_word;
+// appends a word and a newline
+void out_word(out_t *out, const char *word)
+{
+	size_t len = strlen(word);
+	out_reserve(out, len + 1);
+	memcpy(out->data + out->len, word, len);
+	out->data[out->len + len] = '\n';
+	out->len += len + 1;
+}
 
-	trie_node_t **children;
-	int n_children;
+/*statistics*/
+// every command records its latency and the number of trie nodes it
+// visited in log-linear (HDR style) histograms that STATS prints.
+// Building with -DMK_NO_STATS compiles the recording out
+enum {
+	STATS_INSERT,
+	STATS_LOAD,
+	STATS_REMOVE,
+	STATS_FEED,
+	STATS_SAVE,
+	STATS_OPEN,
+	STATS_AUTOCORRECT,
+	STATS_AUTOCOMPLETE,
+	STATS_CONTAINS,
+	STATS_N_COMMANDS
 };
 
-typedef struct trie_t trie_t;
-struct trie_t {
-	trie_node_t *root;
-
-	/* Number of keys */
-	int size;
-
-	/* Generic Data Structure */
-	int data_size;
+#ifndef MK_NO_STATS
+/* 8 buckets per power of two, values are known within 12.5% */
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB)
 
-	/* Trie-Specific, alphabet properties */
-	int alphabet_size;
-	char *alphabet;
+typedef struct stats_hist_t stats_hist_t;
+struct stats_hist_t {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
 
-	/* Callback to free value associated with key, should be called when freeing
-	 */
-	void (*free_value_cb)(void *aux);
+typedef struct stats_command_t stats_command_t;
+struct stats_command_t {
+	/* in nanoseconds */
+	stats_hist_t latency;
+	stats_hist_t nodes;
+	/* the slowest call, to tell what caused a spike */
+	char slowest[80];
+};
 
-	/* Optional - number of nodes, useful to test correctness */
-	int n_nodes;
+stats_command_t stats[STATS_N_COMMANDS];
+char *stats_names[STATS_N_COMMANDS] = {
+	"INSERT", "LOAD", "REMOVE", "FEED", "SAVE", "OPEN", "AUTOCORRECT",
+	"AUTOCOMPLETE", "CONTAINS"
 };
+/* protects the slowest calls, only taken when one of them changes */
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* nodes visited by the current command of this thread */
+__thread uint64_t stats_visited;
+#define STATS_VISIT() (stats_visited++)
+#define STATS_VISITED() stats_visited
+#define STATS_SET_VISITED(n) (stats_visited = (n))
 
-trie_node_t *find_smallest_subtrie(trie_node_t *node);
-trie_node_t *trie_create_node(trie_t *trie)
+int stats_bucket(uint64_t value)
 {
-	trie_node_t *node = calloc(1, sizeof(*node));
-	node->children = calloc(trie->alphabet_size, sizeof(*node->children));
-	trie->n_nodes++;
-	return node;
-	// TODO
+	if (value < STATS_SUB)
+		return value;
+	int shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+	return (shift + 1) * STATS_SUB + (value >> shift) - STATS_SUB;
 }
 
-// initialize trie
-trie_t *trie_create(int data_size, int alphabet_size, char *alphabet,
-					void (*free_value_cb)(void *)
-									 )
+// the highest value that falls in the bucket
+uint64_t stats_bucket_high(int bucket)
 {
-	trie_t *trie = malloc(sizeof(*trie));
-	trie->size = 0;
-	trie->data_size = data_size;
-	trie->alphabet_size = alphabet_size;
-	trie->n_nodes = 0;
-	trie->alphabet = malloc(sizeof(*trie->alphabet) * trie->alphabet_size);
-	memmove(trie->alphabet, alphabet, trie->alphabet_size);
-	trie->root = trie_create_node(trie);
-	trie->free_value_cb = free_value_cb;
-	return trie;
-	// TOD0
+	if (bucket < STATS_SUB)
+		return bucket;
+	int shift = bucket / STATS_SUB - 1;
+	uint64_t low = (uint64_t)(bucket % STATS_SUB + STATS_SUB) << shift;
+	return low + ((1ULL << shift) - 1);
 }
 
-// insert a node in trie
-void insert(trie_t *trie, trie_node_t *node, char *key, void *value)
+void stats_hist_add(stats_hist_t *hist, uint64_t value)
 {
-	if (key[0] == '\0') {
-		if (node->end_of_word == 1) {
-			node->freq++;
-			free(((val *)value)->cuv);
-			return;
-		}
-		node->value = malloc(trie->data_size);
-		// *(int*)(node->value) = *(int*)value;
-		memcpy(node->value, value, trie->data_size);
-		node->freq++;
-		node->end_of_word = 1;
-		trie->size++;
-		return;
+	__atomic_fetch_add(&hist->buckets[stats_bucket(value)], 1,
+					   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (value > max &&
+		   !__atomic_compare_exchange_n(&hist->max, &max, value, 0,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// the value below which "percent" of the samples are, never above the
+// largest sample
+uint64_t stats_percentile(stats_hist_t *hist, double percent)
+{
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	uint64_t target = count * percent / 100, seen = 0;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen > target)
+			return stats_bucket_high(i) < max ? stats_bucket_high(i) : max;
 	}
-	trie_node_t *next_node = node->children[key[0] - 'a'];
-	if (!next_node) {
-		node->children[key[0] - 'a'] = trie_create_node(trie);
-		node->n_children++;
+	return max;
+}
+
+uint64_t stats_begin(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	stats_visited = 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// records a command started at "start", "arg" and "k" describe it
+void stats_end(int command, uint64_t start, char *arg, int k)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t latency = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec -
+					   start;
+	stats_command_t *cmd = &stats[command];
+	uint64_t max = __atomic_load_n(&cmd->latency.max, __ATOMIC_RELAXED);
+	stats_hist_add(&cmd->latency, latency);
+	stats_hist_add(&cmd->nodes, stats_visited);
+	if (latency > max) {
+		pthread_mutex_lock(&stats_lock);
+		if (k < 0)
+			snprintf(cmd->slowest, sizeof(cmd->slowest), "%s %s",
+					 stats_names[command], arg);
+		else
+			snprintf(cmd->slowest, sizeof(cmd->slowest), "%s %s %d",
+					 stats_names[command], arg, k);
+		pthread_mutex_unlock(&stats_lock);
 	}
-	insert(trie, node->children[key[0] - 'a'], key + 1, value);
 }
+#else
+#define STATS_VISIT() ((void)0)
+#define STATS_VISITED() 0
+#define STATS_SET_VISITED(n) ((void)(n))
+#define stats_begin() 0
+#define stats_end(command, start, arg, k) ((void)(start))
+#endif
+
+/*epoch based reclamation*/
+// the queries run without locks while a writer changes the trie. Pointers
+// are published with release stores and read with acquire loads, and the
+// memory a writer unlinks is only freed after every reader that might
+// still hold it has left its read section
+#define LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+/* for the counters STATS reads while a writer changes them */
+#define COUNT_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define EBR_MAX_READERS 64
+
+typedef struct ebr_retired_t ebr_retired_t;
+struct ebr_retired_t {
+	void *ptr;
+	void (*free_cb)(void *aux);
+	unsigned long epoch;
+	ebr_retired_t *next;
+};
+
+typedef struct ebr_slot_t ebr_slot_t;
+struct ebr_slot_t {
+	/* epoch the reader entered in, 0 outside of a read section */
+	unsigned long epoch;
+	int in_use;
+	/* one slot per cache line, readers don't share lines with each other */
+	char pad[64 - sizeof(unsigned long) - sizeof(int)];
+};
+
+typedef struct ebr_t ebr_t;
+struct ebr_t {
+	unsigned long epoch;
+	ebr_slot_t slots[EBR_MAX_READERS];
+	/* newest first, protected by lock */
+	ebr_retired_t *retired;
+	pthread_mutex_t lock;
+};
+
+ebr_t ebr = {.epoch = 1, .lock = PTHREAD_MUTEX_INITIALIZER};
+__thread int ebr_slot = -1;
 
-void trie_insert(trie_t *trie, char *key, void *value)
+// gives the calling thread a reader slot, waits if all of them are taken
+void ebr_register(void)
 {
-	if (trie->root->children[key[0] - 'a'] == NULL) {
-		trie->root->children[key[0] - 'a'] = trie_create_node(trie);
-		trie->root->n_children++;
+	while (ebr_slot < 0) {
+		for (int i = 0; i < EBR_MAX_READERS && ebr_slot < 0; i++) {
+			int expected = 0;
+			if (__atomic_compare_exchange_n(&ebr.slots[i].in_use, &expected, 1,
+											0, __ATOMIC_ACQ_REL,
+											__ATOMIC_RELAXED))
+				ebr_slot = i;
+		}
+		if (ebr_slot < 0)
+			sched_yield();
 	}
-	trie_node_t *next_node = trie->root->children[key[0] - 'a'];
+}
 
-	insert(trie, next_node, key + 1, value);
-	// TODO
+// gives the slot back, called by reader threads before they exit
+void ebr_unregister(void)
+{
+	if (ebr_slot < 0)
+		return;
+	__atomic_store_n(&ebr.slots[ebr_slot].in_use, 0, __ATOMIC_RELEASE);
+	ebr_slot = -1;
 }
 
-void *search(char *key, trie_node_t *node)
+// starts a read section, nothing reachable from now on is freed before
+// the matching ebr_exit
+void ebr_enter(void)
 {
-	if (strlen(key) == 0 && node->end_of_word == 1)
-		return node->value;
-	trie_node_t *next_node = node->children[key[0] - 'a'];
-	if (!next_node)
-		return NULL;
+	if (ebr_slot < 0)
+		ebr_register();
+	unsigned long epoch = __atomic_load_n(&ebr.epoch, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ebr.slots[ebr_slot].epoch, epoch, __ATOMIC_SEQ_CST);
+}
 
-	return search(key + 1, next_node);
+void ebr_exit(void)
+{
+	__atomic_store_n(&ebr.slots[ebr_slot].epoch, 0, __ATOMIC_RELEASE);
 }
 
-void *trie_search(trie_t *trie, char *key)
+// frees "ptr" with "free_cb" once no reader can reach it anymore,
+// it must already be unlinked from everything the readers traverse
+void ebr_retire(void *ptr, void (*free_cb)(void *aux))
 {
-	if (strlen(key) == 0) {
-		void *aux = malloc(sizeof(int *));
-		*(int *)aux = -1;
-		return aux;
-	}
-	if (trie->root->children[key[0] - 'a'] == NULL)
-		return NULL;
-	else
-		return search(key + 1, trie->root->children[key[0] - 'a']);
-	// TODO
+	if (!ptr)
+		return;
+	ebr_retired_t *item = malloc(sizeof(*item));
+	item->ptr = ptr;
+	item->free_cb = free_cb;
+	pthread_mutex_lock(&ebr.lock);
+	item->epoch = __atomic_load_n(&ebr.epoch, __ATOMIC_SEQ_CST);
+	item->next = ebr.retired;
+	ebr.retired = item;
+	pthread_mutex_unlock(&ebr.lock);
 }
 
-// remove a node
-int remove_node(trie_t *trie, trie_node_t *node, char *key)
+// advances the epoch if every active reader has seen the current one and
+// frees what was retired two epochs ago. With "all" set it frees
+// everything, only when no reader is left
+void ebr_collect(int all)
 {
-	if (strlen(key) == 0) {
-		trie->free_value_cb(node->value);
-		if (node->end_of_word == 1) {
-			node->end_of_word = 0;
-			if (node->n_children > 0)
-				return 0;
-			else
-				return 1;
-		}
+	pthread_mutex_lock(&ebr.lock);
+	unsigned long epoch = __atomic_load_n(&ebr.epoch, __ATOMIC_SEQ_CST);
+	int advance = 1;
+	for (int i = 0; i < EBR_MAX_READERS && advance; i++) {
+		unsigned long seen = __atomic_load_n(&ebr.slots[i].epoch,
+											 __ATOMIC_SEQ_CST);
+		if (seen != 0 && seen != epoch)
+			advance = 0;
+	}
+	if (advance)
+		__atomic_store_n(&ebr.epoch, ++epoch, __ATOMIC_SEQ_CST);
+	ebr_retired_t **link = &ebr.retired;
+	while (*link && !all && (*link)->epoch + 2 > epoch)
+		link = &(*link)->next;
+	ebr_retired_t *item = *link;
+	*link = NULL;
+	pthread_mutex_unlock(&ebr.lock);
+	while (item) {
+		ebr_retired_t *next = item->next;
+		item->free_cb(item->ptr);
+		free(item);
+		item = next;
+	}
+}
 
-		return 0;
+/*string pool*/
+// every word is stored once, one after the other in large chunks that are
+// never moved, so the readers can print them while a writer appends more.
+// A word is known by its offset, the upper bits select the chunk. The
+// space of a removed word is kept by its length and taken by the next
+// word of that length
+#define POOL_CHUNK_BITS 20
+#define POOL_CHUNK_SIZE (1 << POOL_CHUNK_BITS)
+#define POOL_MAX_CHUNKS 4096
+#define POOL_MAX_SPARE 64
+#define POOL_NONE UINT32_MAX
+#define POOL_FREE_LENS 64 /* longer words share the last free list */
+
+typedef struct pool_cursor_t pool_cursor_t;
+struct pool_cursor_t {
+	/* free space [next, end) of a chunk, owned by a single writer */
+	uint64_t next;
+	uint64_t end;
+};
+
+typedef struct pool_slot_t pool_slot_t;
+struct pool_slot_t {
+	uint32_t off;
+	int len;
+};
+
+typedef struct pool_slots_t pool_slots_t;
+struct pool_slots_t {
+	pool_slot_t *slots;
+	/* also read without the lock, to skip empty lists */
+	int n_slots;
+	int capacity;
+};
+
+typedef struct pool_t pool_t;
+struct pool_t {
+	char *chunks[POOL_MAX_CHUNKS];
+	int n_chunks;
+	/* space left behind by writers that are done */
+	pool_cursor_t spare[POOL_MAX_SPARE];
+	int n_spare;
+	/* space of removed words, by length */
+	pool_slots_t free[POOL_FREE_LENS + 1];
+	/* taken only to hand out space, not for every word */
+	pthread_mutex_t lock;
+};
+
+// gives back what is left of the cursor's chunk
+void pool_release(pool_t *pool, pool_cursor_t *cursor)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (cursor->next < cursor->end && pool->n_spare < POOL_MAX_SPARE)
+		pool->spare[pool->n_spare++] = *cursor;
+	pthread_mutex_unlock(&pool->lock);
+	cursor->next = cursor->end = 0;
 }
 
-trie_node_t *next_node = node->children[key[0] - 'a'];
-	if (next_node && remove_node(trie, next_node, key + 1) == 1) {
-		free(next_node->children);
-		free(next_node);
-		node->n_children--;
-		trie->n_nodes--;
-		node->children[key[0] - 'a'] = NULL;
-		if (node->n_children == 0 && node->end_of_word == 0)
-			return 1;
+// points the cursor to at least "need" free bytes, returns -1 if the pool
+// is full
+int pool_refill(pool_t *pool, pool_cursor_t *cursor, uint64_t need)
+{
+	pool_release(pool, cursor);
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < pool->n_spare; i++) {
+		if (pool->spare[i].end - pool->spare[i].next < need)
+			continue;
+		*cursor = pool->spare[i];
+		pool->spare[i] = pool->spare[--pool->n_spare];
+		pthread_mutex_unlock(&pool->lock);
 		return 0;
 	}
+	if (pool->n_chunks == POOL_MAX_CHUNKS) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+	// STATS reads the count without the lock
+	int i = pool->n_chunks;
+	STORE_RELEASE(pool->n_chunks, i + 1);
+	STORE_RELEASE(pool->chunks[i], malloc(POOL_CHUNK_SIZE));
+	pthread_mutex_unlock(&pool->lock);
+	cursor->next = (uint64_t)i << POOL_CHUNK_BITS;
+	cursor->end = cursor->next + POOL_CHUNK_SIZE;
 	return 0;
 }
 
-void trie_remove(trie_t *trie, char *key)
+char *pool_word(pool_t *pool, uint32_t off)
 {
-	trie_node_t *next_node = trie->root->children[key[0] - 'a'];
-	if (next_node && remove_node(trie, next_node, key + 1) == 1) {
-		free(next_node->children);
-		free(next_node);
-		trie->n_nodes--;
-		trie->root->n_children--;
-		trie->root->children[key[0] - 'a'] = NULL;
-	}
-	// TODO
+	char *chunk = LOAD_ACQUIRE(pool->chunks[off >> POOL_CHUNK_BITS]);
+	return chunk + (off & (POOL_CHUNK_SIZE - 1));
 }
 
-// free a node from trie
-void trie_free_nod(trie_t *trie, trie_node_t *node)
+// the space of a removed word of "len" letters, or POOL_NONE
+uint32_t pool_take(pool_t *pool, int len)
 {
-	if (!node)
-		return;
-	if (node->end_of_word == 1 && node->value) {
-		trie->free_value_cb(node->value);
-		node->value = NULL;
-	}
-	for (int i = 0; i < trie->alphabet_size; i++) {
-		if (!node->children[i])
+	pool_slots_t *list = &pool->free[len < POOL_FREE_LENS ? len
+														   : POOL_FREE_LENS];
+	if (__atomic_load_n(&list->n_slots, __ATOMIC_RELAXED) == 0)
+		return POOL_NONE;
+	uint32_t off = POOL_NONE;
+	pthread_mutex_lock(&pool->lock);
+	for (int i = list->n_slots - 1; i >= 0; i--) {
+		if (list->slots[i].len != len)
 			continue;
-		trie_free_nod(trie, node->children[i]);
-		node->n_children--;
-		node->children[i] = NULL;
+		off = list->slots[i].off;
+		list->slots[i] = list->slots[list->n_slots - 1];
+		__atomic_store_n(&list->n_slots, list->n_slots - 1, __ATOMIC_RELAXED);
+		break;
 	}
+	pthread_mutex_unlock(&pool->lock);
+	return off;
+}
 
-	free(node->children);
-	node->children = NULL;
-	free(node);
-	trie->n_nodes--;
+// copies the word and its terminator to the pool, returns its offset or
+// POOL_NONE if it doesn't fit
+uint32_t pool_add(pool_t *pool, pool_cursor_t *cursor, const char *word,
+				  int len)
+{
+	if (len + 1 > POOL_CHUNK_SIZE)
+		return POOL_NONE;
+	uint32_t off = pool_take(pool, len);
+	if (off == POOL_NONE) {
+		if (cursor->end - cursor->next < (uint64_t)len + 1 &&
+			pool_refill(pool, cursor, len + 1) < 0)
+			return POOL_NONE;
+		off = cursor->next;
+		cursor->next += len + 1;
+	}
+	char *dest = pool_word(pool, off);
+	memcpy(dest, word, len);
+	dest[len] = '\0';
+	return off;
 }
 
-// free the trie
-void trie_free(trie_t **ptrie)
+typedef struct pool_retired_t pool_retired_t;
+struct pool_retired_t {
+	pool_t *pool;
+	pool_slot_t slot;
+};
+
+// puts a retired word on the free list of its length
+void pool_free_retired(void *aux)
 {
-	trie_free_nod(*ptrie, (*ptrie)->root);
-	free((*ptrie)->alphabet);
-	free(*ptrie);
-	// TODO
+	pool_retired_t *retired = (pool_retired_t *)aux;
+	pool_t *pool = retired->pool;
+	int len = retired->slot.len;
+	pool_slots_t *list = &pool->free[len < POOL_FREE_LENS ? len
+														   : POOL_FREE_LENS];
+	pthread_mutex_lock(&pool->lock);
+	if (list->n_slots == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 16;
+		list->slots = realloc(list->slots,
+							  list->capacity * sizeof(pool_slot_t));
+	}
+	list->slots[list->n_slots] = retired->slot;
+	__atomic_store_n(&list->n_slots, list->n_slots + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+	free(retired);
 }
 
-/*end of trie lab11*/
+// gives back the space of a word once no reader can print it anymore
+void pool_retire(pool_t *pool, uint32_t off, int len)
+{
+	pool_retired_t *retired = malloc(sizeof(*retired));
+	*retired = (pool_retired_t){pool, {off, len}};
+	ebr_retire(retired, pool_free_retired);
+}
 
-// insert a word in trie
-// this function was necessary to adapt the functios implemented in lab11
-// to what this program needs, initializing the val structure
-void insertf(trie_t *trie, char *word)
+void pool_free(pool_t *pool)
 {
-	val *value = malloc(sizeof(val));
-	value->no_letters = strlen(word);
-	value->cuv = malloc(sizeof(char) * (value->no_letters + 1));
-	memcpy(value->cuv, word, value->no_letters + 1);
-	insert(trie, trie->root, word, value);
-	free(value);
+	for (int i = 0; i < pool->n_chunks; i++)
+		free(pool->chunks[i]);
+	for (int i = 0; i <= POOL_FREE_LENS; i++)
+		free(pool->free[i].slots);
+	pthread_mutex_destroy(&pool->lock);
 }
 
-// insert all words from file
-void load(trie_t *trie, char *file_name)
+/*query cache*/
+// the answers of AUTOCOMPLETE and AUTOCORRECT, keyed on (command, argument,
+// k). A change to a word only drops the answers it can alter: the
+// AUTOCOMPLETE of every prefix of the word, and the AUTOCORRECT of the
+// words of the same length within k substitutions of it. The keys are
+// spread over stripes with a lock each, and the entries of a stripe are
+// replaced with the CLOCK algorithm once it is full
+#define CACHE_CAPACITY 4096
+#define CACHE_STRIPES 16
+#define CACHE_MAX_ARG 64	  /* longer arguments are not cached */
+#define CACHE_MAX_ANSWER 4096 /* nor are longer answers */
+#define CACHE_AUTOCOMPLETE 0
+#define CACHE_AUTOCORRECT 1
+#define CACHE_MAX_NO_C 3 /* AUTOCOMPLETE k is 0 to 3 */
+
+/* entries in a new cache, set with mk -c */
+int cache_capacity = CACHE_CAPACITY;
+
+typedef struct cache_entry_t cache_entry_t;
+struct cache_entry_t {
+	uint64_t hash;
+	int type;
+	int k;
+	char *arg;
+	int len;
+	char *answer;
+	size_t answer_len;
+	/* next entry in the bucket, or in the free list */
+	int next;
+	/* AUTOCORRECT entries with an argument of the same length */
+	int prev_len;
+	int next_len;
+	char used;
+	char referenced;
+};
+
+typedef struct cache_stripe_t cache_stripe_t;
+struct cache_stripe_t {
+	cache_entry_t *entries;
+	int capacity;
+	int n_entries;
+	/* entries handed out at least once, the others are past them */
+	int n_touched;
+	int free_list;
+	int *buckets;
+	int n_buckets;
+	int by_len[CACHE_MAX_ARG + 1];
+	/* CLOCK hand */
+	int hand;
+	/* changes on every invalidation, an answer computed meanwhile is stale */
+	uint64_t version;
+	/* bulk loads running, nothing is stored until they are over */
+	int loading;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;
+	pthread_mutex_t lock;
+};
+
+typedef struct cache_t cache_t;
+struct cache_t {
+	/* 0 if the cache is off, it is never locked then */
+	int capacity;
+	cache_stripe_t stripes[CACHE_STRIPES];
+};
+
+void cache_stripe_init(cache_stripe_t *stripe, int capacity)
 {
-	FILE *file;
-	file = fopen(file_name, "r");
-	// read from file
-	if (!file) {
-		printf("Failed to open file");
+	memset(stripe, 0, sizeof(*stripe));
+	pthread_mutex_init(&stripe->lock, NULL);
+	if (capacity <= 0)
 		return;
-	}
-	char word[50];
-	while (fscanf(file, "%s", word) == 1)
-		insertf(trie, word);
-	fclose(file);
+	stripe->capacity = capacity;
+	stripe->entries = calloc(capacity, sizeof(cache_entry_t));
+	for (stripe->n_buckets = 1; stripe->n_buckets < capacity;)
+		stripe->n_buckets *= 2;
+	stripe->buckets = malloc(stripe->n_buckets * sizeof(int));
+	memset(stripe->buckets, -1, stripe->n_buckets * sizeof(int));
+	memset(stripe->by_len, -1, sizeof(stripe->by_len));
+	stripe->free_list = -1;
 }
 
-// a recursive function that dispays the words inserted in the trie which
-// differ by "changes" number of letters from the string "word" given
-void autoccorect_node(trie_t *trie, trie_node_t *node, char *word, int changes)
+void cache_init(cache_t *cache, int capacity)
 {
-	if (changes < 0)
-		return;
-	if (word[0] == '\0') {
-		if (node->end_of_word == 0)
-			return;
-		printf("%s\n", ((val *)node->value)->cuv);
-		return;
+	cache->capacity = capacity > 0 ? capacity : 0;
+	for (int i = 0; i < CACHE_STRIPES; i++)
+		cache_stripe_init(&cache->stripes[i],
+						  cache->capacity / CACHE_STRIPES +
+							  (i < cache->capacity % CACHE_STRIPES));
+}
+
+// FNV-1a of the argument, then of the command and k
+uint64_t cache_hash(int type, int k, const char *arg, int len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)arg[i]) * 1099511628211ULL;
+	hash = (hash ^ (unsigned)type) * 1099511628211ULL;
+	return (hash ^ (unsigned)k) * 1099511628211ULL;
+}
+
+// the low bits of the hash pick the bucket, the high ones the stripe
+cache_stripe_t *cache_stripe(cache_t *cache, uint64_t hash)
+{
+	return &cache->stripes[(hash >> 32) % CACHE_STRIPES];
+}
+
+// the entry for the key, or -1. Called with the lock held
+int cache_find(cache_stripe_t *stripe, int type, int k, const char *arg,
+			   int len, uint64_t hash)
+{
+	if (!stripe->capacity)
+		return -1;
+	int i = stripe->buckets[hash & (stripe->n_buckets - 1)];
+	for (; i != -1; i = stripe->entries[i].next) {
+		cache_entry_t *entry = &stripe->entries[i];
+		if (entry->hash == hash && entry->type == type && entry->k == k &&
+			entry->len == len && memcmp(entry->arg, arg, len) == 0)
+			return i;
 	}
-	for (int i = 0; i < trie->alphabet_size; i++) {
-		if (!node->children[i])
-			continue;
-		if (i == word[0] - 'a')
-			autoccorect_node(trie, node->children[i], word + 1, changes);
+	return -1;
+}
+
+// drops an entry, its slot goes to the free list
+void cache_unlink(cache_stripe_t *stripe, int i)
+{
+	cache_entry_t *entry = &stripe->entries[i];
+	int *link = &stripe->buckets[entry->hash & (stripe->n_buckets - 1)];
+	while (*link != i)
+		link = &stripe->entries[*link].next;
+	*link = entry->next;
+	if (entry->type == CACHE_AUTOCORRECT) {
+		if (entry->prev_len != -1)
+			stripe->entries[entry->prev_len].next_len = entry->next_len;
 		else
-			autoccorect_node(trie, node->children[i], word + 1, changes - 1);
+			stripe->by_len[entry->len] = entry->next_len;
+		if (entry->next_len != -1)
+			stripe->entries[entry->next_len].prev_len = entry->prev_len;
 	}
+	free(entry->arg);
+	free(entry->answer);
+	entry->used = 0;
+	entry->next = stripe->free_list;
+	stripe->free_list = i;
+	stripe->n_entries--;
 }
 
-// finds the smallest lexicographic word with the given prefix
-int autocomplete1(trie_t *trie, trie_node_t *node, char *pref)
+void cache_clear(cache_stripe_t *stripe)
 {
-	if (!node)
-		return 0;
-	if (pref[0] != '\0')
-		return autocomplete1(trie, node->children[pref[0] - 'a'], pref + 1);
-	if (node->end_of_word == 1) {
-		printf("%s\n", ((val *)node->value)->cuv);
-		return 1;
+	for (int i = 0; i < stripe->n_touched; i++)
+		if (stripe->entries[i].used) {
+			cache_unlink(stripe, i);
+			stripe->invalidations++;
+		}
+	stripe->version++;
+}
+
+// a slot for a new entry, evicting one if the stripe is full
+int cache_slot(cache_stripe_t *stripe)
+{
+	if (stripe->free_list == -1 && stripe->n_touched < stripe->capacity)
+		return stripe->n_touched++;
+	while (stripe->free_list == -1) {
+		cache_entry_t *entry = &stripe->entries[stripe->hand];
+		if (entry->referenced) {
+			entry->referenced = 0;
+		} else {
+			cache_unlink(stripe, stripe->hand);
+			stripe->evictions++;
+		}
+		stripe->hand = (stripe->hand + 1) % stripe->capacity;
 	}
-	for (int i = 0; i < trie->alphabet_size; i++)
-		if (autocomplete1(trie, node->children[i], pref) == 1)
-			return 1;
-	return 0;
+	int i = stripe->free_list;
+	stripe->free_list = stripe->entries[i].next;
+	return i;
 }
 
-// finds the shortest word with the given prefix
-int autocomplete2(trie_t *trie, trie_node_t *node, char *pref)
+// appends the cached answer to "out" and returns 1 on a hit. On a miss
+// "version" is what the answer has to be stored with
+int cache_get(cache_t *cache, int type, char *arg, int k, out_t *out,
+			  uint64_t *version)
 {
-	if (!node)
+	*version = 0;
+	if (!cache->capacity)
+		return 0;
+	int len = strlen(arg);
+	uint64_t hash = cache_hash(type, k, arg, len);
+	cache_stripe_t *stripe = cache_stripe(cache, hash);
+	pthread_mutex_lock(&stripe->lock);
+	*version = stripe->version;
+	int i = len <= CACHE_MAX_ARG ? cache_find(stripe, type, k, arg, len, hash)
+								 : -1;
+	if (i == -1) {
+		stripe->misses++;
+		pthread_mutex_unlock(&stripe->lock);
 		return 0;
-	if (pref[0] != '\0')
-		return autocomplete2(trie, node->children[pref[0] - 'a'], pref + 1);
-	if (node->end_of_word == 1 && pref[0] == '\0') {
-		printf("%s\n", ((val *)node->value)->cuv);
-		return 1;
 	}
-	return autocomplete2(trie, find_smallest_subtrie(node), pref);
+	cache_entry_t *entry = &stripe->entries[i];
+	entry->referenced = 1;
+	stripe->hits++;
+	out_reserve(out, entry->answer_len);
+	memcpy(out->data + out->len, entry->answer, entry->answer_len);
+	out->len += entry->answer_len;
+	pthread_mutex_unlock(&stripe->lock);
+	return 1;
 }
 
-// finds the smallest subtrie of the given node
-trie_node_t *find_smallest_subtrie(trie_node_t *node)
+// stores an answer computed after cache_get, unless a word changed since
+void cache_put(cache_t *cache, int type, char *arg, int k, char *answer,
+			   size_t answer_len, uint64_t version)
 {
-	if (!node)
-		return NULL;
-	if (node->end_of_word)
-		return node;
-	trie_node_t *smallest_child = NULL;
-	int smallest_size = __INT_MAX__;
-	for (int i = 0; i < 26; i++) {
-		trie_node_t *current_child = find_smallest_subtrie(node->children[i]);
-		if (current_child && current_child->end_of_word &&
-			((val *)current_child->value)->no_letters < smallest_size
-			 ) {
-			smallest_size = ((val *)current_child->value)->no_letters;
-			smallest_child = current_child;
-		}
+	if (!cache->capacity)
+		return;
+	int len = strlen(arg);
+	if (len > CACHE_MAX_ARG || answer_len > CACHE_MAX_ANSWER)
+		return;
+	if (type == CACHE_AUTOCOMPLETE && (k < 0 || k > CACHE_MAX_NO_C))
+		return;
+	uint64_t hash = cache_hash(type, k, arg, len);
+	cache_stripe_t *stripe = cache_stripe(cache, hash);
+	pthread_mutex_lock(&stripe->lock);
+	if (!stripe->capacity || stripe->version != version || stripe->loading ||
+		cache_find(stripe, type, k, arg, len, hash) != -1) {
+		pthread_mutex_unlock(&stripe->lock);
+		return;
 	}
-	return smallest_child;
+	int i = cache_slot(stripe);
+	cache_entry_t *entry = &stripe->entries[i];
+	*entry = (cache_entry_t){hash, type, k, malloc(len + 1), len,
+							 malloc(answer_len + 1), answer_len, -1, -1, -1,
+							 1, 0};
+	memcpy(entry->arg, arg, len + 1);
+	memcpy(entry->answer, answer, answer_len);
+	int *bucket = &stripe->buckets[hash & (stripe->n_buckets - 1)];
+	entry->next = *bucket;
+	*bucket = i;
+	if (type == CACHE_AUTOCORRECT) {
+		entry->next_len = stripe->by_len[len];
+		if (entry->next_len != -1)
+			stripe->entries[entry->next_len].prev_len = i;
+		stripe->by_len[len] = i;
+	}
+	stripe->n_entries++;
+	pthread_mutex_unlock(&stripe->lock);
 }
 
-// finds the most frequent subtrie of the given node
-trie_node_t *mostfr(trie_node_t *node)
+// drops the answers that a change of "word" can alter. The stripes are
+// locked one after the other, an AUTOCORRECT may be in any of them
+void cache_invalidate(cache_t *cache, const char *word)
 {
-	if (!node)
-		return NULL;
-	trie_node_t *smallest_child = NULL;
-	int biggestfr = -1;
-	for (int i = 0; i < 26; i++) {
-		trie_node_t *current_child = mostfr(node->children[i]);
-		if (current_child && current_child->end_of_word &&
-			current_child->freq > biggestfr
-			 ) {
-			biggestfr = current_child->freq;
-			smallest_child = current_child;
+	if (!cache->capacity)
+		return;
+	int len = strlen(word);
+	// the AUTOCOMPLETE of every prefix, hashed once a stripe has entries
+	uint64_t hashes[CACHE_MAX_ARG + 1][CACHE_MAX_NO_C + 1];
+	int hashed = 0;
+	for (int s = 0; s < CACHE_STRIPES; s++) {
+		cache_stripe_t *stripe = &cache->stripes[s];
+		pthread_mutex_lock(&stripe->lock);
+		stripe->version++;
+		if (stripe->n_entries && !hashed) {
+			for (int i = 1; i <= len && i <= CACHE_MAX_ARG; i++)
+				for (int k = 0; k <= CACHE_MAX_NO_C; k++)
+					hashes[i][k] = cache_hash(CACHE_AUTOCOMPLETE, k, word, i);
+			hashed = 1;
 		}
+		for (int i = 1; stripe->n_entries && i <= len && i <= CACHE_MAX_ARG;
+			 i++)
+			for (int k = 0; k <= CACHE_MAX_NO_C; k++) {
+				if (cache_stripe(cache, hashes[i][k]) != stripe)
+					continue;
+				int j = cache_find(stripe, CACHE_AUTOCOMPLETE, k, word, i,
+								   hashes[i][k]);
+				if (j != -1) {
+					cache_unlink(stripe, j);
+					stripe->invalidations++;
+				}
+			}
+		// the AUTOCORRECT that reach the word
+		int i = stripe->n_entries && len <= CACHE_MAX_ARG
+					? stripe->by_len[len]
+					: -1;
+		while (i != -1) {
+			cache_entry_t *entry = &stripe->entries[i];
+			int next = entry->next_len, changes = 0;
+			for (int j = 0; j < len && changes <= entry->k; j++)
+				changes += entry->arg[j] != word[j];
+			if (changes <= entry->k) {
+				cache_unlink(stripe, i);
+				stripe->invalidations++;
+			}
+			i = next;
+		}
+		pthread_mutex_unlock(&stripe->lock);
 	}
-	if (node->end_of_word && node->freq >= biggestfr) {
-		smallest_child = node;
-		biggestfr = node->freq;
-	}
-	return smallest_child;
 }
 
-// finds the most frequently used word with the given prefix
-int autocomplete3(trie_t *trie, trie_node_t *node, char *pref)
+// a bulk load changes too many words to track them, the cache is emptied
+// before and after and nothing is stored in between
+void cache_bulk(cache_t *cache, int begin)
 {
-	if (!node)
-		return 0;
-	if (pref[0] != '\0')
-		return autocomplete3(trie, node->children[pref[0] - 'a'], pref + 1);
-	trie_node_t *found = mostfr(node);
-	if (found) {
-		printf("%s\n", ((val *)found->value)->cuv);
-		return 1;
+	for (int s = 0; s < CACHE_STRIPES && cache->capacity; s++) {
+		cache_stripe_t *stripe = &cache->stripes[s];
+		pthread_mutex_lock(&stripe->lock);
+		cache_clear(stripe);
+		stripe->loading += begin ? 1 : -1;
+		pthread_mutex_unlock(&stripe->lock);
 	}
-	return 0;
 }
 
-// depending on the variable "no_c", it is decided which autocomplete
-// function to be called
-void autocomplete(trie_t *trie, trie_node_t *node, char *pref, int no_c)
+void cache_free(cache_t *cache)
 {
-	if (no_c == 1) {
-		if (autocomplete1(trie, node, pref) == 0)
-			printf("No words found\n");
-	} else if (no_c == 2) {
-		if (autocomplete2(trie, node, pref) == 0)
-			printf("No words found\n");
-	} else if (no_c == 3) {
-		if (autocomplete3(trie, node, pref) == 0)
-			printf("No words found\n");
-	} else if (no_c == 0) {
-		autocomplete(trie, node, pref, 1);
-		autocomplete(trie, node, pref, 2);
-		autocomplete(trie, node, pref, 3);
+	for (int s = 0; s < CACHE_STRIPES; s++) {
+		cache_stripe_t *stripe = &cache->stripes[s];
+		cache_clear(stripe);
+		free(stripe->entries);
+		free(stripe->buckets);
+		pthread_mutex_destroy(&stripe->lock);
 	}
 }
 
-int main(void)
+/*Trie lab11*/
+typedef struct trie_node_t trie_node_t;
+
+// up to 64 letters a node has a slot for each of them. A node of a wider
+// alphabet only stores the children it has, ranked by a bitmap of letters
+#if ALPHABET_SIZE > 64
+#define TRIE_SPARSE
+typedef struct trie_children_t trie_children_t;
+struct trie_children_t {
+	/* bit i is set if letter i has a child */
+	uint64_t bits[ALPHABET_SIZE / 64];
+	/* the children in the order of their letters */
+	trie_node_t *nodes[];
+};
+#endif
+
+struct trie_node_t {
+	/*frequency of the word*/
+	int freq;
+	/* 1 if current node marks the end of a word, 0 otherwise */
+	int end_of_word;
+	/* offset of the word in the string pool, kept after a remove so that
+	 * inserting the word again reuses it, given back with the node */
+	uint32_t word;
+	/* length of the word, 0 until the node first ends a word */
+	int no_letters;
+	/* 1 + id of the word in the substring index, 0 if it isn't there */
+	uint32_t ngram_id;
+
+#ifdef TRIE_SPARSE
+	/* never changed in place, a writer replaces the whole set */
+	trie_children_t *children;
+#else
+	trie_node_t *children[ALPHABET_SIZE];
+#endif
+	int n_children;
+};
+
+/*substring index*/
+// CONTAINS finds the words in posting lists of their n-grams of 1 to 3
+// letters. A fragment of up to 3 letters is answered by one list, a longer
+// one by checking the words of its rarest trigram. A removed word is only
+// marked dead, the lists are rewritten once most of their words are dead
+#define NGRAM_MAX 3
+#define NGRAM_MIN_COMPACT 1024
+// words indexed by LOAD per hold of the write lock
+#define NGRAM_BATCH 4096
+
+typedef struct ngram_list_t ngram_list_t;
+struct ngram_list_t {
+	/* length and letters of the gram, 0 for a free slot */
+	uint32_t key;
+	uint32_t n_ids;
+	uint32_t capacity;
+	uint32_t *ids;
+};
+
+typedef struct ngram_t ngram_t;
+struct ngram_t {
+	/* open addressing table of the lists */
+	ngram_list_t *lists;
+	uint32_t n_lists;
+	uint32_t n_grams;
+	/* the word of every id, NULL once it is removed */
+	trie_node_t **nodes;
+	uint32_t n_ids;
+	uint32_t capacity;
+	uint32_t n_dead;
+	size_t n_postings;
+	/* taken for reading by the queries, for writing under the trie lock */
+	pthread_rwlock_t lock;
+};
+
+void ngram_init(ngram_t *ngram)
+{
+	memset(ngram, 0, sizeof(*ngram));
+	ngram->n_lists = 1024;
+	ngram->lists = calloc(ngram->n_lists, sizeof(ngram_list_t));
+	pthread_rwlock_init(&ngram->lock, NULL);
+}
+
+uint32_t ngram_key(const char *gram, int len)
 {
-	char command[20], word[50], filename[50], pref[50];
-	int k;
-	trie_t *trie = trie_create(sizeof(val), ALPHABET_SIZE, ALPHABET, free_val);
-	while (1) {
-		scanf("%s", command);
-		if (strncmp(command, "INSERT", 6) == 0) {
-			scanf("%s", word);
-			insertf(trie, word);
-		} else if (strncmp(command, "LOAD", 4) == 0) {
-			scanf("%s", filename);
-			load(trie, filename);
-		} else if (strncmp(command, "REMOVE", 6) == 0) {
-			scanf("%s", word);
-			trie_remove(trie, word);
-		} else if (strncmp(command, "AUTOCORRECT", 11) == 0) {
-			scanf("%s", word);
-			scanf("%d", &k);
-			autoccorect_node(trie, trie->root, word, k);
-		} else if (strncmp(command, "AUTOCOMPLETE", 12) == 0) {
-			scanf("%s", pref);
-			scanf("%d", &k);
-			autocomplete(trie, trie->root, pref, k);
-		} else if (strncmp(command, "EXIT", 4) == 0) {
-			trie_free(&trie);
-			break;
-		}
+	uint32_t key = len;
+	for (int i = 0; i < len; i++)
+		key = key << 8 | (unsigned char)gram[i];
+	return key;
+}
+
+ngram_list_t *ngram_slot(ngram_list_t *lists, uint32_t n_lists, uint32_t key)
+{
+	uint32_t i = key * 2654435761u & (n_lists - 1);
+	while (lists[i].key != 0 && lists[i].key != key)
+		i = (i + 1) & (n_lists - 1);
+	return &lists[i];
+}
+
+// the list of a gram, or NULL if no word has it
+ngram_list_t *ngram_find(ngram_t *ngram, uint32_t key)
+{
+	ngram_list_t *list = ngram_slot(ngram->lists, ngram->n_lists, key);
+	return list->key ? list : NULL;
+}
+
+void ngram_push(ngram_t *ngram, uint32_t key, uint32_t id)
+{
+	if (2 * (ngram->n_grams + 1) > ngram->n_lists) {
+		uint32_t n_lists = 2 * ngram->n_lists;
+		ngram_list_t *lists = calloc(n_lists, sizeof(ngram_list_t));
+		for (uint32_t i = 0; i < ngram->n_lists; i++)
+			if (ngram->lists[i].key)
+				*ngram_slot(lists, n_lists, ngram->lists[i].key) =
+					ngram->lists[i];
+		free(ngram->lists);
+		ngram->lists = lists;
+		ngram->n_lists = n_lists;
+	}
+	ngram_list_t *list = ngram_slot(ngram->lists, ngram->n_lists, key);
+	if (!list->key) {
+		list->key = key;
+		ngram->n_grams++;
+	}
+	if (list->n_ids == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 4;
+		list->ids = realloc(list->ids, list->capacity * sizeof(uint32_t));
+	}
+	list->ids[list->n_ids++] = id;
+	ngram->n_postings++;
+}
+
+int ngram_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// adds a word that just got inserted. Called with the write lock held
+void ngram_add_locked(ngram_t *ngram, pool_t *pool, trie_node_t *node)
+{
+	if (ngram->n_ids == ngram->capacity) {
+		ngram->capacity = ngram->capacity ? 2 * ngram->capacity : 1024;
+		ngram->nodes = realloc(ngram->nodes,
+							   ngram->capacity * sizeof(trie_node_t *));
+	}
+	uint32_t id = ngram->n_ids++;
+	ngram->nodes[id] = node;
+	node->ngram_id = id + 1;
+
+	// every distinct gram of the word once
+	const char *word = pool_word(pool, node->word);
+	int len = node->no_letters, n_keys = 0;
+	uint32_t *keys = malloc(NGRAM_MAX * len * sizeof(uint32_t));
+	for (int i = 0; i < len; i++)
+		for (int n = 1; n <= NGRAM_MAX && i + n <= len; n++)
+			keys[n_keys++] = ngram_key(word + i, n);
+	qsort(keys, n_keys, sizeof(uint32_t), ngram_cmp);
+	for (int i = 0; i < n_keys; i++)
+		if (i == 0 || keys[i] != keys[i - 1])
+			ngram_push(ngram, keys[i], id);
+	free(keys);
+}
+
+void ngram_add(ngram_t *ngram, pool_t *pool, trie_node_t *node)
+{
+	pthread_rwlock_wrlock(&ngram->lock);
+	ngram_add_locked(ngram, pool, node);
+	pthread_rwlock_unlock(&ngram->lock);
+}
+
+// drops the dead words from the lists and numbers the others again
+void ngram_compact(ngram_t *ngram)
+{
+	uint32_t *ids = malloc(ngram->n_ids * sizeof(uint32_t)), n_ids = 0;
+	for (uint32_t i = 0; i < ngram->n_ids; i++)
+		ids[i] = ngram->nodes[i] ? n_ids++ : UINT32_MAX;
+	ngram->n_postings = 0;
+	for (uint32_t i = 0; i < ngram->n_lists; i++) {
+		ngram_list_t *list = &ngram->lists[i];
+		uint32_t n = 0;
+		for (uint32_t j = 0; j < list->n_ids; j++)
+			if (ids[list->ids[j]] != UINT32_MAX)
+				list->ids[n++] = ids[list->ids[j]];
+		list->n_ids = n;
+		ngram->n_postings += n;
+	}
+	for (uint32_t i = 0; i < ngram->n_ids; i++)
+		if (ids[i] != UINT32_MAX) {
+			ngram->nodes[ids[i]] = ngram->nodes[i];
+			ngram->nodes[ids[i]]->ngram_id = ids[i] + 1;
+		}
+	ngram->n_ids = n_ids;
+	ngram->n_dead = 0;
+	free(ids);
+}
+
+// marks a removed word dead. Called with the trie write lock held
+void ngram_remove(ngram_t *ngram, trie_node_t *node)
+{
+	if (node->ngram_id == 0)
+		return;
+	pthread_rwlock_wrlock(&ngram->lock);
+	ngram->nodes[node->ngram_id - 1] = NULL;
+	node->ngram_id = 0;
+	ngram->n_dead++;
+	if (ngram->n_dead >= NGRAM_MIN_COMPACT && 2 * ngram->n_dead > ngram->n_ids)
+		ngram_compact(ngram);
+	pthread_rwlock_unlock(&ngram->lock);
+}
+
+size_t ngram_bytes(ngram_t *ngram)
+{
+	return ngram->n_lists * sizeof(ngram_list_t) +
+		   ngram->capacity * sizeof(trie_node_t *) +
+		   ngram->n_postings * sizeof(uint32_t);
+}
+
+void ngram_free(ngram_t *ngram)
+{
+	for (uint32_t i = 0; i < ngram->n_lists; i++)
+		free(ngram->lists[i].ids);
+	free(ngram->lists);
+	free(ngram->nodes);
+	pthread_rwlock_destroy(&ngram->lock);
+}
+
+typedef struct trie_t trie_t;
+struct trie_t {
+	trie_node_t *root;
+
+	/* Number of keys */
+	int size;
+
+	/* Trie-Specific, alphabet properties */
+	int alphabet_size;
+	char *alphabet;
+	/* index of every byte in the alphabet, -1 if it isn't a letter */
+	int16_t letters[256];
+
+	/* Optional - number of nodes, useful to test correctness */
+	int n_nodes;
+
+	/* Writers are serialized among themselves, readers never take it */
+	pthread_mutex_t write_lock;
+
+	/* the words, and the space the writer holding write_lock appends to */
+	pool_t pool;
+	pool_cursor_t cursor;
+
+	/* answers of the queries, invalidated by the writers */
+	cache_t cache;
+
+	/* n-grams of the words, for CONTAINS */
+	ngram_t ngram;
+};
+
+// the index of a letter, -1 if it isn't in the alphabet
+int trie_index(trie_t *trie, char c)
+{
+	return trie->letters[(unsigned char)c];
+}
+
+// 1 if every letter of the word is in the alphabet
+int trie_valid(trie_t *trie, const char *word)
+{
+	for (; *word; word++)
+		if (trie_index(trie, *word) < 0)
+			return 0;
+	return 1;
+}
+
+#ifdef TRIE_SPARSE
+// the position of letter i among the children of the set
+int trie_rank(trie_children_t *set, int i)
+{
+	int rank = 0;
+	for (int j = 0; j < i / 64; j++)
+		rank += __builtin_popcountll(set->bits[j]);
+	return rank + __builtin_popcountll(set->bits[i / 64] &
+									   ((1ULL << (i % 64)) - 1));
+}
+#endif
+
+// loads a child for a reader, the node behind it is fully initialized.
+// There is none for a letter outside of the alphabet (i = -1)
+trie_node_t *trie_child(trie_node_t *node, int i)
+{
+	if (i < 0)
+		return NULL;
+#ifdef TRIE_SPARSE
+	trie_children_t *set = LOAD_ACQUIRE(node->children);
+	if (!set || !(set->bits[i / 64] >> (i % 64) & 1))
+		return NULL;
+	return set->nodes[trie_rank(set, i)];
+#else
+	return LOAD_ACQUIRE(node->children[i]);
+#endif
+}
+
+// the first letter from i on that has a child, ALPHABET_SIZE if none
+int trie_next_child(trie_node_t *node, int i)
+{
+#ifdef TRIE_SPARSE
+	trie_children_t *set = LOAD_ACQUIRE(node->children);
+	for (; set && i < ALPHABET_SIZE; i = (i / 64 + 1) * 64) {
+		uint64_t bits = set->bits[i / 64] >> (i % 64);
+		if (bits)
+			return i + __builtin_ctzll(bits);
+	}
+	return ALPHABET_SIZE;
+#else
+	while (i < ALPHABET_SIZE && !LOAD_ACQUIRE(node->children[i]))
+		i++;
+	return i;
+#endif
+}
+
+// links the child of letter i, or unlinks it when "child" is NULL. Only
+// for the writer, a sparse node gets a new set and the old one is retired,
+// or freed at once if the node isn't "shared" with the readers yet
+void trie_set_child(trie_node_t *node, int i, trie_node_t *child, int shared)
+{
+#ifdef TRIE_SPARSE
+	trie_children_t *set = node->children, *copy = NULL;
+	int n = 0, rank = 0, present = 0;
+	if (set) {
+		for (int j = 0; j < ALPHABET_SIZE / 64; j++)
+			n += __builtin_popcountll(set->bits[j]);
+		rank = trie_rank(set, i);
+		present = set->bits[i / 64] >> (i % 64) & 1;
+	}
+	if (present && child) {
+		STORE_RELEASE(set->nodes[rank], child);
+		return;
+	}
+	if (!present && !child)
+		return;
+	int n_copy = child ? n + 1 : n - 1;
+	if (n_copy > 0) {
+		copy = malloc(sizeof(*copy) + n_copy * sizeof(trie_node_t *));
+		memset(copy->bits, 0, sizeof(copy->bits));
+		if (set) {
+			memcpy(copy->bits, set->bits, sizeof(copy->bits));
+			memcpy(copy->nodes, set->nodes, rank * sizeof(trie_node_t *));
+		}
+		copy->bits[i / 64] ^= 1ULL << (i % 64);
+		if (child) {
+			copy->nodes[rank] = child;
+			if (set)
+				memcpy(copy->nodes + rank + 1, set->nodes + rank,
+					   (n - rank) * sizeof(trie_node_t *));
+		} else {
+			memcpy(copy->nodes + rank, set->nodes + rank + 1,
+				   (n - rank - 1) * sizeof(trie_node_t *));
+		}
+	}
+	STORE_RELEASE(node->children, copy);
+	if (shared)
+		ebr_retire(set, free);
+	else
+		free(set);
+#else
+	(void)shared;
+	STORE_RELEASE(node->children[i], child);
+#endif
+}
+
+// what the nodes take, without the allocator overhead
+size_t trie_node_bytes(trie_t *trie)
+{
+	size_t n_nodes = __atomic_load_n(&trie->n_nodes, __ATOMIC_RELAXED);
+	size_t bytes = n_nodes * sizeof(trie_node_t);
+#ifdef TRIE_SPARSE
+	// at most a set per node, and every node but the root is in one
+	bytes += n_nodes * sizeof(trie_children_t) +
+			 (n_nodes - 1) * sizeof(trie_node_t *);
+#endif
+	return bytes;
+}
+
+// frees a node unlinked by a writer, its children are already gone
+void trie_free_retired(void *aux)
+{
+	trie_node_t *node = (trie_node_t *)aux;
+#ifdef TRIE_SPARSE
+	free(node->children);
+#endif
+	free(node);
+}
+
+// retires a node unlinked by a writer, with the word it kept in the pool
+void trie_retire_node(trie_t *trie, trie_node_t *node)
+{
+	if (node->no_letters)
+		pool_retire(&trie->pool, node->word, node->no_letters);
+	ebr_retire(node, trie_free_retired);
+}
+
+trie_node_t *find_smallest_subtrie(trie_node_t *node);
+// allocates a node without counting it, for subtries built off the trie
+trie_node_t *trie_alloc_node(void)
+{
+	return calloc(1, sizeof(trie_node_t));
+}
+
+trie_node_t *trie_create_node(trie_t *trie)
+{
+	trie_node_t *node = trie_alloc_node();
+	COUNT_ADD(trie->n_nodes, 1);
+	return node;
+	// TODO
+}
+
+// initialize trie, a NULL alphabet has every byte as a letter. The nodes
+// have room for ALPHABET_SIZE letters at most
+trie_t *trie_create(int alphabet_size, char *alphabet)
+{
+	if (alphabet_size > ALPHABET_SIZE || alphabet_size > 256) {
+		fprintf(stderr, "Alphabet of %d letters, built for %d\n",
+				alphabet_size, ALPHABET_SIZE);
+		return NULL;
+	}
+	trie_t *trie = calloc(1, sizeof(*trie));
+	trie->size = 0;
+	trie->alphabet_size = alphabet_size;
+	trie->n_nodes = 0;
+	trie->alphabet = malloc(sizeof(*trie->alphabet) * trie->alphabet_size);
+	for (int i = 0; i < alphabet_size; i++)
+		trie->alphabet[i] = alphabet ? alphabet[i] : (char)i;
+	memset(trie->letters, -1, sizeof(trie->letters));
+	for (int i = 0; i < alphabet_size; i++)
+		trie->letters[(unsigned char)trie->alphabet[i]] = i;
+	trie->root = trie_create_node(trie);
+	pthread_mutex_init(&trie->write_lock, NULL);
+	pthread_mutex_init(&trie->pool.lock, NULL);
+	cache_init(&trie->cache, cache_capacity);
+	ngram_init(&trie->ngram);
+	return trie;
+	// TOD0
+}
+
+// adds two frequencies, stopping at INT_MAX
+int freq_add(int freq, int count)
+{
+	return freq > INT_MAX - count ? INT_MAX : freq + count;
+}
+
+// adds "count" to the frequency of the word ending in "node", the word
+// is copied to the pool (with the given cursor) only the first time the
+// node ends a word. Returns 1 if the node just became a word, -1 if the
+// pool is full and the word can't be stored
+int trie_mark_word(trie_t *trie, pool_cursor_t *cursor, trie_node_t *node,
+				   const char *word, int len, int count)
+{
+	if (node->end_of_word == 1) {
+		STORE_RELEASE(node->freq, freq_add(node->freq, count));
+		return 0;
+	}
+	if (node->no_letters == 0) {
+		uint32_t off = pool_add(&trie->pool, cursor, word, len);
+		if (off == POOL_NONE)
+			return -1;
+		node->word = off;
+		node->no_letters = len;
+	}
+	// the word is published before it becomes visible
+	STORE_RELEASE(node->freq, freq_add(node->freq, count));
+	STORE_RELEASE(node->end_of_word, 1);
+	return 1;
+}
+
+// insert a node in trie, "word" is the whole key and "key" what is left
+// of it below "node", the frequency grows by "count". Returns -1 if the
+// word can't be stored, the nodes made for it are removed again
+int insert(trie_t *trie, trie_node_t *node, char *key, char *word, int count)
+{
+	STATS_VISIT();
+	if (key[0] == '\0') {
+		int marked = trie_mark_word(trie, &trie->cursor, node, word,
+									key - word, count);
+		if (marked == 1) {
+			COUNT_ADD(trie->size, 1);
+			ngram_add(&trie->ngram, &trie->pool, node);
+		}
+		return marked < 0 ? -1 : 0;
+	}
+	int i = trie_index(trie, key[0]);
+	trie_node_t *next_node = trie_child(node, i);
+	int created = !next_node;
+	if (created) {
+		next_node = trie_create_node(trie);
+		trie_set_child(node, i, next_node, 1);
+		node->n_children++;
+	}
+	if (insert(trie, next_node, key + 1, word, count) == 0)
+		return 0;
+	// the nodes below were removed on the way back, a reader may hold them
+	if (created) {
+		trie_set_child(node, i, NULL, 1);
+		trie_retire_node(trie, next_node);
+		node->n_children--;
+		COUNT_ADD(trie->n_nodes, -1);
+	}
+	return -1;
+}
+
+int insertf(trie_t *trie, char *word, int count);
+
+// same as insertf, so the cache and the failed inserts are handled once
+int trie_insert(trie_t *trie, char *key)
+{
+	return insertf(trie, key, 1);
+}
+
+trie_node_t *search(trie_t *trie, char *key, trie_node_t *node)
+{
+	STATS_VISIT();
+	if (strlen(key) == 0 && LOAD_ACQUIRE(node->end_of_word) == 1)
+		return node;
+	if (strlen(key) == 0)
+		return NULL;
+	trie_node_t *next_node = trie_child(node, trie_index(trie, key[0]));
+	if (!next_node)
+		return NULL;
+
+	return search(trie, key + 1, next_node);
+}
+
+// returns the stored copy of the word, or NULL
+char *trie_search(trie_t *trie, char *key)
+{
+	if (strlen(key) == 0)
+		return NULL;
+	trie_node_t *next_node = trie_child(trie->root, trie_index(trie, key[0]));
+	if (next_node)
+		next_node = search(trie, key + 1, next_node);
+	if (next_node == NULL)
+		return NULL;
+	else
+		return pool_word(&trie->pool, next_node->word);
+	// TODO
+}
+
+// remove a node
+int remove_node(trie_t *trie, trie_node_t *node, char *key)
+{
+	STATS_VISIT();
+	if (strlen(key) == 0) {
+		if (node->end_of_word == 1) {
+			// the word stays in the pool, a reader that saw it still prints it
+			STORE_RELEASE(node->end_of_word, 0);
+			ngram_remove(&trie->ngram, node);
+			COUNT_ADD(trie->size, -1);
+			if (node->n_children > 0)
+				return 0;
+			else
+				return 1;
+		}
+
+		return 0;
+}
+
+	int i = trie_index(trie, key[0]);
+	trie_node_t *next_node = trie_child(node, i);
+	if (next_node && remove_node(trie, next_node, key + 1) == 1) {
+		trie_set_child(node, i, NULL, 1);
+		trie_retire_node(trie, next_node);
+		node->n_children--;
+		COUNT_ADD(trie->n_nodes, -1);
+		if (node->n_children == 0 && node->end_of_word == 0)
+			return 1;
+		return 0;
+	}
+	return 0;
+}
+
+void trie_remove(trie_t *trie, char *key)
+{
+	pthread_mutex_lock(&trie->write_lock);
+	int i = trie_index(trie, key[0]);
+	trie_node_t *next_node = trie_child(trie->root, i);
+	if (next_node && remove_node(trie, next_node, key + 1) == 1) {
+		trie_set_child(trie->root, i, NULL, 1);
+		trie_retire_node(trie, next_node);
+		COUNT_ADD(trie->n_nodes, -1);
+		trie->root->n_children--;
+	}
+	cache_invalidate(&trie->cache, key);
+	pthread_mutex_unlock(&trie->write_lock);
+	ebr_collect(0);
+	// TODO
+}
+
+// free a node from trie
+void trie_free_nod(trie_t *trie, trie_node_t *node)
+{
+	if (!node)
+		return;
+	for (int i = trie_next_child(node, 0); i < ALPHABET_SIZE;
+		 i = trie_next_child(node, i + 1)) {
+		trie_free_nod(trie, trie_child(node, i));
+		node->n_children--;
+	}
+
+#ifdef TRIE_SPARSE
+	free(node->children);
+#endif
+	free(node);
+	trie->n_nodes--;
+}
+
+// free the trie, no reader or writer may be left
+void trie_free(trie_t **ptrie)
+{
+	ebr_collect(1);
+	pthread_mutex_destroy(&(*ptrie)->write_lock);
+	trie_free_nod(*ptrie, (*ptrie)->root);
+	pool_free(&(*ptrie)->pool);
+	cache_free(&(*ptrie)->cache);
+	ngram_free(&(*ptrie)->ngram);
+	free((*ptrie)->alphabet);
+	free(*ptrie);
+	// TODO
+}
+
+/*end of trie lab11*/
+
+// insert a word in trie
+// this function was necessary to adapt the functios implemented in lab11
+// to what this program needs, taking the write lock. The word is counted
+// "count" times with a single walk. Returns -1 if the word can't be stored
+// and -2 if it has letters outside of the alphabet
+int insertf(trie_t *trie, char *word, int count)
+{
+	if (!trie_valid(trie, word))
+		return -2;
+	pthread_mutex_lock(&trie->write_lock);
+	int ret = insert(trie, trie->root, word, word, count);
+	cache_invalidate(&trie->cache, word);
+	pthread_mutex_unlock(&trie->write_lock);
+	ebr_collect(0);
+	return ret;
+}
+
+/*bulk loader*/
+// LOAD reads the whole file at once and splits its words by their first
+// letter. Every shard is the subtrie below one child of the root and is
+// built by a single worker, so the workers never share a node. Subtries
+// that didn't exist yet are linked under the root at the end.
+// A word may be followed on its line by a TAB and a count ("word<TAB>count"
+// files of query logs), the repeated words of a shard are summed up first so
+// that every distinct word walks the trie only once
+#define LOAD_BLOCK_SIZE (1 << 20)
+
+typedef struct load_word_t load_word_t;
+struct load_word_t {
+	/* offset of the word in the file */
+	size_t off;
+	int len;
+	/* occurrences, 0 once they have been added to an earlier copy */
+	int count;
+};
+
+typedef struct load_shard_t load_shard_t;
+struct load_shard_t {
+	/* the words that start with the letter of the shard */
+	load_word_t *words;
+	int n_words;
+	int capacity;
+	/* child of the root, new ones aren't linked until the end */
+	trie_node_t *root;
+	int linked;
+	int n_nodes;
+	int size;
+	/* words that didn't fit in the pool */
+	int n_failed;
+	/* the words that are new, indexed once the workers are done */
+	trie_node_t **added;
+	int n_added;
+	int added_capacity;
+};
+
+typedef struct load_job_t load_job_t;
+struct load_job_t {
+	trie_t *trie;
+	const char *data;
+	size_t data_size;
+	load_shard_t *shards;
+	/* next shard to be built, taken by the workers */
+	int next_shard;
+	/* nodes the workers visited, counted for the command */
+	uint64_t visited;
+};
+
+// maps a regular file, anything else is read in large blocks
+char *load_read_file(char *file_name, size_t *size, int *mapped)
+{
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	*size = 0;
+	*mapped = 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			close(fd);
+			*size = st.st_size;
+			*mapped = 1;
+			return map;
+		}
+	}
+	size_t capacity = LOAD_BLOCK_SIZE;
+	char *data = malloc(capacity);
+	ssize_t n;
+	while ((n = read(fd, data + *size, capacity - *size)) > 0) {
+		*size += n;
+		if (*size == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+	}
+	close(fd);
+	return data;
+}
+
+// the length of the word at the start of "word", -1 if it has letters
+// outside of the alphabet
+int load_word_len(const load_job_t *job, const char *word)
+{
+	const char *end = job->data + job->data_size;
+	int len = 0, valid = 1;
+	for (; word + len < end && !isspace((unsigned char)word[len]); len++)
+		if (trie_index(job->trie, word[len]) < 0)
+			valid = 0;
+	return valid ? len : -len;
+}
+
+// reads the count that may follow a word and a TAB on its line and moves
+// "pos" past it, returns 1 if there is none. After a space digits are a
+// word of their own, they are letters in the wider alphabets
+int load_count(const load_job_t *job, size_t *pos)
+{
+	const char *data = job->data;
+	size_t p = *pos;
+	if (p == job->data_size || data[p] != '\t')
+		return 1;
+	while (p < job->data_size && (data[p] == ' ' || data[p] == '\t'))
+		p++;
+	if (p == job->data_size || !isdigit((unsigned char)data[p]))
+		return 1;
+	long long count = 0;
+	for (; p < job->data_size && isdigit((unsigned char)data[p]); p++)
+		if ((count = count * 10 + data[p] - '0') > INT_MAX)
+			count = INT_MAX;
+	if (p < job->data_size && !isspace((unsigned char)data[p]))
+		return 1;
+	*pos = p;
+	return count;
+}
+
+// splits the words of the file by their first letter
+void load_split(load_job_t *job)
+{
+	size_t pos = 0;
+	while (pos < job->data_size) {
+		if (isspace((unsigned char)job->data[pos])) {
+			pos++;
+			continue;
+		}
+		size_t start = pos;
+		int len = load_word_len(job, job->data + pos);
+		pos += len > 0 ? len : -len;
+		if (len <= 0)
+			continue;
+		int count = load_count(job, &pos);
+		if (count == 0)
+			continue;
+		load_shard_t *shard =
+			&job->shards[trie_index(job->trie, job->data[start])];
+		if (shard->n_words == shard->capacity) {
+			shard->capacity = shard->capacity ? 2 * shard->capacity : 1024;
+			shard->words = realloc(shard->words,
+								   shard->capacity * sizeof(load_word_t));
+		}
+		shard->words[shard->n_words++] = (load_word_t){start, len, count};
+	}
+}
+
+// FNV-1a
+uint64_t load_hash(const char *word, int len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)word[i]) * 1099511628211ULL;
+	return hash;
+}
+
+// adds the count of every repeated word of the shard to its first copy,
+// in an open addressing table of indices into shard->words
+void load_aggregate(load_job_t *job, load_shard_t *shard)
+{
+	int size = 1;
+	while (size < 2 * shard->n_words)
+		size *= 2;
+	int *table = malloc(size * sizeof(*table));
+	memset(table, -1, size * sizeof(*table));
+	for (int j = 0; j < shard->n_words; j++) {
+		load_word_t *word = &shard->words[j];
+		const char *key = job->data + word->off;
+		uint64_t slot = load_hash(key, word->len) & (size - 1);
+		for (;; slot = (slot + 1) & (size - 1)) {
+			if (table[slot] < 0) {
+				table[slot] = j;
+				break;
+			}
+			load_word_t *first = &shard->words[table[slot]];
+			if (first->len == word->len &&
+				memcmp(job->data + first->off, key, word->len) == 0) {
+				first->count = freq_add(first->count, word->count);
+				word->count = 0;
+				break;
+			}
+		}
+	}
+	free(table);
+}
+
+// inserts a word into the subtrie of its shard, it is published the same
+// way as in insert since the subtrie may already be visible to readers.
+// Returns -1 if the word can't be stored, the nodes made for it are removed
+int load_insert(load_job_t *job, load_shard_t *shard, pool_cursor_t *cursor,
+				const char *word, int len, int count)
+{
+	trie_node_t *node = shard->root, *parent = NULL, *first = NULL;
+	int first_c = 0;
+	STATS_VISIT();
+	for (int i = 1; i < len; i++) {
+		STATS_VISIT();
+		int c = trie_index(job->trie, word[i]);
+		trie_node_t *child = trie_child(node, c);
+		if (!child) {
+			child = trie_alloc_node();
+			trie_set_child(node, c, child, shard->linked);
+			node->n_children++;
+			shard->n_nodes++;
+			if (!first) {
+				parent = node;
+				first = child;
+				first_c = c;
+			}
+		}
+		node = child;
+	}
+	int marked = trie_mark_word(job->trie, cursor, node, word, len, count);
+	if (marked < 0 && first) {
+		// the new nodes are a chain with one child each
+		trie_set_child(parent, first_c, NULL, shard->linked);
+		parent->n_children--;
+		for (trie_node_t *next; first; first = next) {
+			int c = trie_next_child(first, 0);
+			next = c < ALPHABET_SIZE ? trie_child(first, c) : NULL;
+			if (shard->linked)
+				ebr_retire(first, trie_free_retired);
+			else
+				trie_free_retired(first);
+			shard->n_nodes--;
+		}
+	}
+	if (marked != 1)
+		return marked;
+	shard->size++;
+	if (shard->n_added == shard->added_capacity) {
+		shard->added_capacity = shard->added_capacity
+									? 2 * shard->added_capacity
+									: 64;
+		shard->added = realloc(shard->added, shard->added_capacity *
+												 sizeof(*shard->added));
+	}
+	shard->added[shard->n_added++] = node;
+	return 0;
+}
+
+void *load_worker(void *aux)
+{
+	load_job_t *job = (load_job_t *)aux;
+	// every worker appends to its own part of the pool
+	pool_cursor_t cursor = {0, 0};
+	uint64_t visited = STATS_VISITED();
+	int i;
+	while ((i = __atomic_fetch_add(&job->next_shard, 1, __ATOMIC_RELAXED)) <
+		   job->trie->alphabet_size) {
+		load_shard_t *shard = &job->shards[i];
+		load_aggregate(job, shard);
+		for (int j = 0; j < shard->n_words; j++) {
+			load_word_t *word = &shard->words[j];
+			if (word->count > 0)
+				if (load_insert(job, shard, &cursor, job->data + word->off,
+								word->len, word->count) != 0)
+					shard->n_failed++;
+		}
+	}
+	pool_release(&job->trie->pool, &cursor);
+	// handed to the thread of the command, which may be this one
+	__atomic_fetch_add(&job->visited, STATS_VISITED() - visited,
+					   __ATOMIC_RELAXED);
+	STATS_SET_VISITED(visited);
+	return NULL;
+}
+
+// insert all words from file, returns -1 if it can't be read and -2 if
+// some of the words can't be stored
+int load(trie_t *trie, char *file_name)
+{
+	size_t data_size;
+	int mapped;
+	char *data = load_read_file(file_name, &data_size, &mapped);
+	// read from file
+	if (!data)
+		return -1;
+	load_job_t job = {trie, data, data_size, NULL, 0, 0};
+	job.shards = calloc(trie->alphabet_size, sizeof(*job.shards));
+	load_split(&job);
+
+	// the workers are the writer, other writers wait for the whole file
+	pthread_mutex_lock(&trie->write_lock);
+	cache_bulk(&trie->cache, 1);
+	for (int i = 0; i < trie->alphabet_size; i++) {
+		load_shard_t *shard = &job.shards[i];
+		shard->root = trie_child(trie->root, i);
+		shard->linked = shard->root != NULL;
+		if (!shard->root && shard->n_words > 0) {
+			shard->root = trie_alloc_node();
+			shard->n_nodes++;
+		}
+	}
+
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads > trie->alphabet_size)
+		n_threads = trie->alphabet_size;
+	pthread_t *threads = malloc(n_threads * sizeof(*threads));
+	int started = 0;
+	for (; started < n_threads; started++)
+		if (pthread_create(&threads[started], NULL, load_worker, &job) != 0)
+			break;
+	// with no worker left the shards are built here
+	if (started == 0)
+		load_worker(&job);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	STATS_SET_VISITED(STATS_VISITED() + job.visited);
+
+	// the index lock is dropped between batches so that CONTAINS isn't
+	// blocked for the whole file
+	for (int i = 0; i < trie->alphabet_size; i++) {
+		load_shard_t *shard = &job.shards[i];
+		for (int j = 0; j < shard->n_added; j += NGRAM_BATCH) {
+			pthread_rwlock_wrlock(&trie->ngram.lock);
+			for (int k = j; k < shard->n_added && k < j + NGRAM_BATCH; k++)
+				ngram_add_locked(&trie->ngram, &trie->pool, shard->added[k]);
+			pthread_rwlock_unlock(&trie->ngram.lock);
+		}
+		free(shard->added);
+	}
+	int n_failed = 0;
+	for (int i = 0; i < trie->alphabet_size; i++) {
+		load_shard_t *shard = &job.shards[i];
+		free(shard->words);
+		n_failed += shard->n_failed;
+		// a new subtrie whose words all failed
+		if (!shard->linked && shard->root && !shard->root->n_children &&
+			!shard->root->end_of_word) {
+			trie_free_retired(shard->root);
+			shard->root = NULL;
+			shard->n_nodes--;
+		}
+		COUNT_ADD(trie->n_nodes, shard->n_nodes);
+		COUNT_ADD(trie->size, shard->size);
+		if (shard->root && !trie_child(trie->root, i)) {
+			trie_set_child(trie->root, i, shard->root, 1);
+			trie->root->n_children++;
+		}
+	}
+	cache_bulk(&trie->cache, 0);
+	pthread_mutex_unlock(&trie->write_lock);
+	ebr_collect(0);
+	free(job.shards);
+	if (mapped)
+		munmap(data, data_size);
+	else
+		free(data);
+	return n_failed ? -2 : 0;
+}
+
+// a recursive function that dispays the words inserted in the trie which
+// differ by "changes" number of letters from the string "word" given
+void autoccorect_node(trie_t *trie, trie_node_t *node, char *word, int changes,
+					  out_t *out)
+{
+	if (changes < 0)
+		return;
+	STATS_VISIT();
+	if (word[0] == '\0') {
+		if (LOAD_ACQUIRE(node->end_of_word) == 0)
+			return;
+		out_word(out, pool_word(&trie->pool, node->word));
+		return;
+	}
+	int letter = trie_index(trie, word[0]);
+	for (int i = trie_next_child(node, 0); i < ALPHABET_SIZE;
+		 i = trie_next_child(node, i + 1)) {
+		trie_node_t *child = trie_child(node, i);
+		if (!child)
+			continue;
+		if (i == letter)
+			autoccorect_node(trie, child, word + 1, changes, out);
+		else
+			autoccorect_node(trie, child, word + 1, changes - 1, out);
+	}
+}
+
+// finds the smallest lexicographic word with the given prefix
+int autocomplete1(trie_t *trie, trie_node_t *node, char *pref, out_t *out)
+{
+	if (!node)
+		return 0;
+	STATS_VISIT();
+	if (pref[0] != '\0')
+		return autocomplete1(trie, trie_child(node, trie_index(trie, pref[0])),
+							 pref + 1, out);
+	if (LOAD_ACQUIRE(node->end_of_word) == 1) {
+		out_word(out, pool_word(&trie->pool, node->word));
+		return 1;
+	}
+	for (int i = trie_next_child(node, 0); i < ALPHABET_SIZE;
+		 i = trie_next_child(node, i + 1))
+		if (autocomplete1(trie, trie_child(node, i), pref, out) == 1)
+			return 1;
+	return 0;
+}
+
+// finds the shortest word with the given prefix
+int autocomplete2(trie_t *trie, trie_node_t *node, char *pref, out_t *out)
+{
+	if (!node)
+		return 0;
+	STATS_VISIT();
+	if (pref[0] != '\0')
+		return autocomplete2(trie, trie_child(node, trie_index(trie, pref[0])),
+							 pref + 1, out);
+	if (LOAD_ACQUIRE(node->end_of_word) == 1 && pref[0] == '\0') {
+		out_word(out, pool_word(&trie->pool, node->word));
+		return 1;
+	}
+	return autocomplete2(trie, find_smallest_subtrie(node), pref, out);
+}
+
+// finds the smallest subtrie of the given node
+trie_node_t *find_smallest_subtrie(trie_node_t *node)
+{
+	if (!node)
+		return NULL;
+	STATS_VISIT();
+	if (LOAD_ACQUIRE(node->end_of_word))
+		return node;
+	trie_node_t *smallest_child = NULL;
+	int smallest_size = __INT_MAX__;
+	for (int i = trie_next_child(node, 0); i < ALPHABET_SIZE;
+		 i = trie_next_child(node, i + 1)) {
+		trie_node_t *current_child = find_smallest_subtrie(trie_child(node, i));
+		if (!current_child)
+			continue;
+		if (current_child->no_letters < smallest_size) {
+			smallest_size = current_child->no_letters;
+			smallest_child = current_child;
+		}
+	}
+	return smallest_child;
+}
+
+// finds the most frequent subtrie of the given node
+trie_node_t *mostfr(trie_node_t *node)
+{
+	if (!node)
+		return NULL;
+	STATS_VISIT();
+	trie_node_t *smallest_child = NULL;
+	int biggestfr = -1;
+	for (int i = trie_next_child(node, 0); i < ALPHABET_SIZE;
+		 i = trie_next_child(node, i + 1)) {
+		trie_node_t *current_child = mostfr(trie_child(node, i));
+		int freq = current_child ? LOAD_ACQUIRE(current_child->freq) : 0;
+		if (current_child && freq > biggestfr) {
+			biggestfr = freq;
+			smallest_child = current_child;
+		}
+	}
+	int freq = LOAD_ACQUIRE(node->freq);
+	if (LOAD_ACQUIRE(node->end_of_word) && freq >= biggestfr) {
+		smallest_child = node;
+		biggestfr = freq;
+	}
+	return smallest_child;
+}
+
+// finds the most frequently used word with the given prefix
+int autocomplete3(trie_t *trie, trie_node_t *node, char *pref, out_t *out)
+{
+	if (!node)
+		return 0;
+	STATS_VISIT();
+	if (pref[0] != '\0')
+		return autocomplete3(trie, trie_child(node, trie_index(trie, pref[0])),
+							 pref + 1, out);
+	trie_node_t *found = mostfr(node);
+	if (found) {
+		out_word(out, pool_word(&trie->pool, found->word));
+		return 1;
+	}
+	return 0;
+}
+
+// depending on the variable "no_c", it is decided which autocomplete
+// function to be called
+void autocomplete(trie_t *trie, trie_node_t *node, char *pref, int no_c,
+				  out_t *out)
+{
+	if (no_c == 1) {
+		if (autocomplete1(trie, node, pref, out) == 0)
+			out_word(out, "No words found");
+	} else if (no_c == 2) {
+		if (autocomplete2(trie, node, pref, out) == 0)
+			out_word(out, "No words found");
+	} else if (no_c == 3) {
+		if (autocomplete3(trie, node, pref, out) == 0)
+			out_word(out, "No words found");
+	} else if (no_c == 0) {
+		autocomplete(trie, node, pref, 1, out);
+		autocomplete(trie, node, pref, 2, out);
+		autocomplete(trie, node, pref, 3, out);
+	}
+}
+
+// CONTAINS: the "n" most frequent words with "pattern" anywhere in them,
+// ranked by freq like mostfr and then in lexicographic order
+#define CONTAINS_DEFAULT 10
+
+typedef struct contains_hit_t contains_hit_t;
+struct contains_hit_t {
+	int freq;
+	char *word;
+};
+
+// 1 if "a" ranks before "b"
+int contains_before(contains_hit_t *a, contains_hit_t *b)
+{
+	if (a->freq != b->freq)
+		return a->freq > b->freq;
+	return strcmp(a->word, b->word) < 0;
+}
+
+int contains_cmp(const void *a, const void *b)
+{
+	contains_hit_t *x = (contains_hit_t *)a, *y = (contains_hit_t *)b;
+	return contains_before(y, x) - contains_before(x, y);
+}
+
+// the best hits so far are kept in a heap with the worst of them on top
+void contains_keep(contains_hit_t *heap, int *n_hits, int n, contains_hit_t hit)
+{
+	int i;
+	if (*n_hits < n) {
+		for (i = (*n_hits)++; i > 0 && contains_before(&heap[(i - 1) / 2],
+													   &hit); i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = hit;
+		return;
+	}
+	if (!contains_before(&hit, &heap[0]))
+		return;
+	for (i = 0;;) {
+		int worst = 2 * i + 1;
+		if (worst >= n)
+			break;
+		if (worst + 1 < n && contains_before(&heap[worst], &heap[worst + 1]))
+			worst++;
+		if (!contains_before(&hit, &heap[worst]))
+			break;
+		heap[i] = heap[worst];
+		i = worst;
+	}
+	heap[i] = hit;
+}
+
+// returns -1 if the heap of "n" hits can't be allocated
+int contains(trie_t *trie, char *pattern, int n, out_t *out)
+{
+	ngram_t *ngram = &trie->ngram;
+	int len = strlen(pattern), n_hits = 0;
+	pthread_rwlock_rdlock(&ngram->lock);
+	// no more hits than live words
+	if ((uint32_t)n > ngram->n_ids - ngram->n_dead)
+		n = ngram->n_ids - ngram->n_dead;
+	contains_hit_t *heap = malloc((n ? n : 1) * sizeof(*heap));
+	if (!heap) {
+		pthread_rwlock_unlock(&ngram->lock);
+		return -1;
+	}
+	// a short pattern is a gram, a longer one is in the list of each of
+	// its trigrams and the shortest of them is checked
+	ngram_list_t *list = NULL;
+	if (len <= NGRAM_MAX)
+		list = ngram_find(ngram, ngram_key(pattern, len));
+	for (int i = 0; len > NGRAM_MAX && i + NGRAM_MAX <= len; i++) {
+		ngram_list_t *other = ngram_find(ngram, ngram_key(pattern + i,
+														  NGRAM_MAX));
+		if (!other) {
+			list = NULL;
+			break;
+		}
+		if (!list || other->n_ids < list->n_ids)
+			list = other;
+	}
+	for (uint32_t i = 0; n && list && i < list->n_ids; i++) {
+		trie_node_t *node = ngram->nodes[list->ids[i]];
+		STATS_VISIT();
+		if (!node || !LOAD_ACQUIRE(node->end_of_word))
+			continue;
+		contains_hit_t hit = {LOAD_ACQUIRE(node->freq),
+							  pool_word(&trie->pool, node->word)};
+		if (len > NGRAM_MAX && !strstr(hit.word, pattern))
+			continue;
+		contains_keep(heap, &n_hits, n, hit);
+	}
+	pthread_rwlock_unlock(&ngram->lock);
+	qsort(heap, n_hits, sizeof(*heap), contains_cmp);
+	for (int i = 0; i < n_hits; i++)
+		out_word(out, heap[i].word);
+	if (n_hits == 0)
+		out_word(out, "No words found");
+	free(heap);
+	return 0;
+}
+
+/*double-array trie snapshot*/
+// SAVE writes the trie to a read-only image that OPEN maps back with mmap:
+// the child of state s by letter c lives in cell base[s] + c and is valid
+// only if the check of that cell is s. The root is state 0.
+#define DAT_MAGIC "MKDA"
+#define DAT_VERSION 1
+
+typedef struct dat_header_t dat_header_t;
+struct dat_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t alphabet_size;
+	uint32_t n_cells;
+	/* Number of keys */
+	uint32_t n_keys;
+	/* depth of the deepest state, used to size the query buffers */
+	uint32_t max_len;
+	char alphabet[256];
+};
+
+typedef struct dat_cell_t dat_cell_t;
+struct dat_cell_t {
+	int32_t base;
+	/* parent state, -1 if the cell is unused */
+	int32_t check;
+	/* frequency of the word, 0 if the state doesn't end a word */
+	int32_t freq;
+};
+
+typedef struct dat_t dat_t;
+struct dat_t {
+	const dat_header_t *header;
+	const dat_cell_t *cells;
+	size_t map_size;
+	/* index of every byte in the alphabet of the header, -1 if none */
+	int16_t letters[256];
+};
+
+typedef struct dat_builder_t dat_builder_t;
+struct dat_builder_t {
+	dat_cell_t *cells;
+	int n_cells;
+	int capacity;
+	/* doubly linked list of the unused cells, in increasing order */
+	int *free_next;
+	int *free_prev;
+	int free_head;
+	int free_tail;
+	/* how many placements have failed on each unused cell */
+	int *free_fail;
+};
+
+// grows the builder so that it has at least "size" cells
+void dat_reserve(dat_builder_t *b, int size)
+{
+	if (size <= b->capacity)
+		return;
+	int capacity = b->capacity ? b->capacity : 1024;
+	while (capacity < size)
+		capacity *= 2;
+	b->cells = realloc(b->cells, capacity * sizeof(*b->cells));
+	b->free_next = realloc(b->free_next, capacity * sizeof(*b->free_next));
+	b->free_prev = realloc(b->free_prev, capacity * sizeof(*b->free_prev));
+	b->free_fail = realloc(b->free_fail, capacity * sizeof(*b->free_fail));
+	if (b->capacity == 0)
+		b->free_head = b->free_tail = -1;
+	for (int i = b->capacity; i < capacity; i++) {
+		b->cells[i].base = 0;
+		b->cells[i].check = -1;
+		b->cells[i].freq = 0;
+		b->free_next[i] = -1;
+		b->free_fail[i] = 0;
+		b->free_prev[i] = b->free_tail;
+		if (b->free_tail >= 0)
+			b->free_next[b->free_tail] = i;
+		else
+			b->free_head = i;
+		b->free_tail = i;
+	}
+	b->capacity = capacity;
+}
+
+// takes a cell out of the list of unused cells
+void dat_unlink(dat_builder_t *b, int pos)
+{
+	if (b->free_prev[pos] >= 0)
+		b->free_next[b->free_prev[pos]] = b->free_next[pos];
+	else
+		b->free_head = b->free_next[pos];
+	if (b->free_next[pos] >= 0)
+		b->free_prev[b->free_next[pos]] = b->free_prev[pos];
+	else
+		b->free_tail = b->free_prev[pos];
+	b->free_next[pos] = b->free_prev[pos] = -1;
+}
+
+// marks a cell as used by the given parent
+void dat_use(dat_builder_t *b, int pos, int parent)
+{
+	b->cells[pos].check = parent;
+	dat_unlink(b, pos);
+	if (pos >= b->n_cells)
+		b->n_cells = pos + 1;
+}
+
+// finds the first base for which all the cells base + labels[i] are free,
+// only the unused cells are tried for the first label. A cell that keeps
+// failing is dropped from the list and stays a hole, otherwise every node
+// with several children would rescan the holes at the front of the array
+#define DAT_MAX_FAIL 16
+int dat_find_base(dat_builder_t *b, int *labels, int n, int alphabet_size)
+{
+	int pos = b->free_head;
+	for (;;) {
+		if (pos < 0 || pos + alphabet_size >= b->capacity) {
+			int last = b->capacity;
+			dat_reserve(b, b->capacity + alphabet_size + 1);
+			if (pos < 0)
+				pos = last;
+		}
+		int base = pos - labels[0], i;
+		for (i = 1; i < n && base >= 1; i++)
+			if (b->cells[base + labels[i]].check != -1)
+				break;
+		if (base >= 1 && i == n)
+			return base;
+		int next = b->free_next[pos];
+		if (++b->free_fail[pos] >= DAT_MAX_FAIL)
+			dat_unlink(b, pos);
+		pos = next;
+	}
+}
+
+// places the nodes of the trie in breadth first order, so that the cell of
+// every state is fixed before its children are placed. It only reads the
+// trie, a writer may keep inserting meanwhile
+void dat_build(trie_t *trie, dat_builder_t *b, dat_header_t *header)
+{
+	typedef struct {
+		trie_node_t *node;
+		int state;
+		int depth;
+	} dat_item_t;
+	int capacity = __atomic_load_n(&trie->n_nodes, __ATOMIC_RELAXED) + 1;
+	dat_item_t *queue = malloc(capacity * sizeof(*queue));
+	int *labels = malloc(trie->alphabet_size * sizeof(*labels));
+	trie_node_t **children = malloc(trie->alphabet_size * sizeof(*children));
+	int head = 0, tail = 0;
+
+	dat_reserve(b, trie->alphabet_size + 1);
+	dat_use(b, 0, 0);
+	queue[tail++] = (dat_item_t){trie->root, 0, 0};
+	while (head < tail) {
+		dat_item_t item = queue[head++];
+		trie_node_t *node = item.node;
+		if (LOAD_ACQUIRE(node->end_of_word) == 1) {
+			b->cells[item.state].freq = LOAD_ACQUIRE(node->freq);
+			header->n_keys++;
+		}
+		if ((uint32_t)item.depth > header->max_len)
+			header->max_len = item.depth;
+		int n = 0;
+		for (int i = trie_next_child(node, 0); i < ALPHABET_SIZE;
+			 i = trie_next_child(node, i + 1)) {
+			children[n] = trie_child(node, i);
+			if (children[n])
+				labels[n++] = i;
+		}
+		if (n == 0)
+			continue;
+		if (tail + n > capacity) {
+			capacity = 2 * capacity + n;
+			queue = realloc(queue, capacity * sizeof(*queue));
+		}
+		int base = dat_find_base(b, labels, n, trie->alphabet_size);
+		b->cells[item.state].base = base;
+		for (int i = 0; i < n; i++) {
+			int state = base + labels[i];
+			dat_use(b, state, item.state);
+			queue[tail++] = (dat_item_t){children[i], state, item.depth + 1};
+		}
+	}
+	header->n_cells = b->n_cells;
+	free(children);
+	free(labels);
+	free(queue);
+}
+
+// writes the snapshot next to its final name and renames it, so that the
+// processes that have the old file mapped keep a consistent copy
+int dat_write_file(char *file_name, const dat_header_t *header,
+				   const dat_cell_t *cells)
+{
+	char *tmp_name = malloc(strlen(file_name) + 5);
+	sprintf(tmp_name, "%s.tmp", file_name);
+	FILE *file = fopen(tmp_name, "wb");
+	if (!file) {
+		free(tmp_name);
+		return -1;
+	}
+	int ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+			 fwrite(cells, sizeof(*cells), header->n_cells, file) ==
+			 header->n_cells;
+	if (fclose(file) != 0)
+		ok = 0;
+	if (ok && rename(tmp_name, file_name) != 0)
+		ok = 0;
+	if (!ok)
+		remove(tmp_name);
+	free(tmp_name);
+	return ok ? 0 : -1;
+}
+
+// compiles the trie to a double-array snapshot
+int dat_save(trie_t *trie, char *file_name)
+{
+	dat_header_t header;
+	dat_builder_t b = {0};
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DAT_MAGIC, 4);
+	header.version = DAT_VERSION;
+	header.alphabet_size = trie->alphabet_size;
+	memcpy(header.alphabet, trie->alphabet, trie->alphabet_size);
+	dat_build(trie, &b, &header);
+	int ret = dat_write_file(file_name, &header, b.cells);
+	free(b.cells);
+	free(b.free_next);
+	free(b.free_prev);
+	free(b.free_fail);
+	return ret;
+}
+
+// maps a snapshot read-only, the pages are shared by every process that
+// opens the same file
+dat_t *dat_open(char *file_name, trie_t *trie)
+{
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(dat_header_t)) {
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	const dat_header_t *header = map;
+	if (memcmp(header->magic, DAT_MAGIC, 4) != 0 ||
+		header->version != DAT_VERSION ||
+		header->alphabet_size != (uint32_t)trie->alphabet_size ||
+		memcmp(header->alphabet, trie->alphabet, trie->alphabet_size) != 0 ||
+		header->n_cells == 0 || header->max_len >= header->n_cells ||
+		(size_t)st.st_size != sizeof(*header) +
+		(size_t)header->n_cells * sizeof(dat_cell_t)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	dat_t *dat = malloc(sizeof(*dat));
+	dat->header = header;
+	dat->cells = (const dat_cell_t *)(header + 1);
+	dat->map_size = st.st_size;
+	memset(dat->letters, -1, sizeof(dat->letters));
+	for (uint32_t i = 0; i < header->alphabet_size; i++)
+		dat->letters[(unsigned char)header->alphabet[i]] = i;
+	return dat;
+}
+
+void dat_free(void *aux)
+{
+	dat_t *dat = (dat_t *)aux;
+	munmap((void *)dat->header, dat->map_size);
+	free(dat);
+}
+
+// unmaps the snapshot once the readers that are still using it are done
+void dat_close(dat_t **pdat)
+{
+	dat_t *dat = *pdat;
+	if (!dat)
+		return;
+	STORE_RELEASE(*pdat, NULL);
+	ebr_retire(dat, dat_free);
+}
+
+// returns the child of "state" by the letter with index c, or -1
+int dat_child(const dat_t *dat, int state, int c)
+{
+	int64_t next = (int64_t)dat->cells[state].base + c;
+	if (c < 0 || next <= 0 || next >= dat->header->n_cells ||
+		dat->cells[next].check != state)
+		return -1;
+	return next;
+}
+
+// descends along the given prefix, returns the reached state or -1
+int dat_walk(const dat_t *dat, char *pref)
+{
+	int state = 0;
+	for (; pref[0] != '\0' && state >= 0; pref++) {
+		STATS_VISIT();
+		state = dat_child(dat, state, dat->letters[(unsigned char)pref[0]]);
+	}
+	return state;
+}
+
+// same as autoccorect_node, the word is rebuilt in buf while descending.
+// It is no longer than max_len, dat_autocorrect checks it
+void dat_autocorrect_node(const dat_t *dat, int state, char *word,
+						  int changes, char *buf, int depth, out_t *out)
+{
+	if (changes < 0)
+		return;
+	STATS_VISIT();
+	if (word[0] == '\0') {
+		if (dat->cells[state].freq == 0)
+			return;
+		buf[depth] = '\0';
+		out_word(out, buf);
+		return;
+	}
+	int letter = dat->letters[(unsigned char)word[0]];
+	for (uint32_t i = 0; i < dat->header->alphabet_size; i++) {
+		int next = dat_child(dat, state, i);
+		if (next < 0)
+			continue;
+		buf[depth] = dat->header->alphabet[i];
+		if ((int)i == letter)
+			dat_autocorrect_node(dat, next, word + 1, changes, buf, depth + 1,
+								 out);
+		else
+			dat_autocorrect_node(dat, next, word + 1, changes - 1, buf,
+								 depth + 1, out);
+	}
+}
+
+void dat_autocorrect(const dat_t *dat, char *word, int changes, out_t *out)
+{
+	if (strlen(word) > dat->header->max_len)
+		return;
+	char *buf = malloc(dat->header->max_len + 1);
+	dat_autocorrect_node(dat, 0, word, changes, buf, 0, out);
+	free(buf);
+}
+
+// the first word in lexicographic order below "state"
+int dat_autocomplete1(const dat_t *dat, int state, char *buf, int depth,
+					  out_t *out)
+{
+	STATS_VISIT();
+	if (dat->cells[state].freq > 0) {
+		buf[depth] = '\0';
+		out_word(out, buf);
+		return 1;
+	}
+	if ((uint32_t)depth >= dat->header->max_len)
+		return 0;
+	for (uint32_t i = 0; i < dat->header->alphabet_size; i++) {
+		int next = dat_child(dat, state, i);
+		if (next < 0)
+			continue;
+		buf[depth] = dat->header->alphabet[i];
+		if (dat_autocomplete1(dat, next, buf, depth + 1, out) == 1)
+			return 1;
+	}
+	return 0;
+}
+
+// keeps in "best" the shortest word below "state", on equal lengths the
+// lexicographically smallest one wins, like in find_smallest_subtrie
+void dat_shortest(const dat_t *dat, int state, char *buf, int depth,
+				  char *best, int *best_len)
+{
+	if (depth >= *best_len)
+		return;
+	STATS_VISIT();
+	if (dat->cells[state].freq > 0) {
+		memcpy(best, buf, depth);
+		best[depth] = '\0';
+		*best_len = depth;
+		return;
+	}
+	if ((uint32_t)depth >= dat->header->max_len)
+		return;
+	for (uint32_t i = 0; i < dat->header->alphabet_size; i++) {
+		int next = dat_child(dat, state, i);
+		if (next < 0)
+			continue;
+		buf[depth] = dat->header->alphabet[i];
+		dat_shortest(dat, next, buf, depth + 1, best, best_len);
+	}
+}
+
+// keeps in "best" the most frequent word below "state", on equal
+// frequencies the first one in preorder wins, like in mostfr
+void dat_mostfr(const dat_t *dat, int state, char *buf, int depth,
+				char *best, int *best_freq)
+{
+	STATS_VISIT();
+	if (dat->cells[state].freq > *best_freq) {
+		memcpy(best, buf, depth);
+		best[depth] = '\0';
+		*best_freq = dat->cells[state].freq;
+	}
+	if ((uint32_t)depth >= dat->header->max_len)
+		return;
+	for (uint32_t i = 0; i < dat->header->alphabet_size; i++) {
+		int next = dat_child(dat, state, i);
+		if (next < 0)
+			continue;
+		buf[depth] = dat->header->alphabet[i];
+		dat_mostfr(dat, next, buf, depth + 1, best, best_freq);
+	}
+}
+
+// same as autocomplete, answered from the snapshot
+void dat_autocomplete(const dat_t *dat, char *pref, int no_c, out_t *out)
+{
+	if (no_c == 0) {
+		dat_autocomplete(dat, pref, 1, out);
+		dat_autocomplete(dat, pref, 2, out);
+		dat_autocomplete(dat, pref, 3, out);
+		return;
+	}
+	if (no_c < 1 || no_c > 3)
+		return;
+	int state = dat_walk(dat, pref);
+	int found = 0;
+	if (state >= 0 && strlen(pref) <= dat->header->max_len) {
+		int depth = strlen(pref);
+		char *buf = malloc(2 * (dat->header->max_len + 1));
+		char *best = buf + dat->header->max_len + 1;
+		memcpy(buf, pref, depth);
+		if (no_c == 1) {
+			found = dat_autocomplete1(dat, state, buf, depth, out);
+		} else if (no_c == 2) {
+			int best_len = __INT_MAX__;
+			dat_shortest(dat, state, buf, depth, best, &best_len);
+			found = best_len != __INT_MAX__;
+		} else {
+			int best_freq = 0;
+			dat_mostfr(dat, state, buf, depth, best, &best_freq);
+			found = best_freq > 0;
+		}
+		if (found && no_c != 1)
+			out_word(out, best);
+		free(buf);
+	}
+	if (!found)
+		out_word(out, "No words found");
+}
+
+// rebuilds the heap trie below "node" from the snapshot
+void dat_thaw_node(const dat_t *dat, int state, trie_t *trie,
+				   trie_node_t *node, char *buf, int depth)
+{
+	if (dat->cells[state].freq > 0 &&
+		trie_mark_word(trie, &trie->cursor, node, buf, depth,
+					   dat->cells[state].freq) == 1) {
+		COUNT_ADD(trie->size, 1);
+		ngram_add(&trie->ngram, &trie->pool, node);
+	}
+	if ((uint32_t)depth >= dat->header->max_len)
+		return;
+	for (uint32_t i = 0; i < dat->header->alphabet_size; i++) {
+		int next = dat_child(dat, state, i);
+		if (next < 0)
+			continue;
+		trie_node_t *child = trie_child(node, i);
+		if (!child) {
+			child = trie_create_node(trie);
+			trie_set_child(node, i, child, 1);
+			node->n_children++;
+		}
+		buf[depth] = dat->header->alphabet[i];
+		dat_thaw_node(dat, next, trie, child, buf, depth + 1);
+	}
+}
+
+// the snapshot is read-only, before the first change the words are copied
+// back into the (empty) heap trie and the mapping is dropped
+void dat_thaw(dat_t **pdat, trie_t *trie)
+{
+	if (!*pdat)
+		return;
+	char *buf = malloc((*pdat)->header->max_len + 1);
+	pthread_mutex_lock(&trie->write_lock);
+	dat_thaw_node(*pdat, 0, trie, trie->root, buf, 0);
+	pthread_mutex_unlock(&trie->write_lock);
+	free(buf);
+	dat_close(pdat);
+	ebr_collect(0);
+}
+
+/*background feed*/
+// FEED loads a file from another thread, the queries keep being answered
+// from the trie while the words are inserted
+typedef struct feed_t feed_t;
+struct feed_t {
+	pthread_t thread;
+	trie_t *trie;
+	char file_name[PATH_MAX];
+	int running;
+};
+
+void *feed_run(void *aux)
+{
+	feed_t *feed = (feed_t *)aux;
+	uint64_t start = stats_begin();
+	int ret = load(feed->trie, feed->file_name);
+	if (ret == -1)
+		fprintf(stderr, "Failed to open file %s\n", feed->file_name);
+	else if (ret != 0)
+		fprintf(stderr, "Failed to insert every word of %s\n",
+				feed->file_name);
+	stats_end(STATS_FEED, start, feed->file_name, -1);
+	return NULL;
+}
+
+// waits for the current feed to finish
+void feed_wait(feed_t *feed)
+{
+	if (!feed->running)
+		return;
+	pthread_join(feed->thread, NULL);
+	feed->running = 0;
+}
+
+int feed_start(feed_t *feed, trie_t *trie, char *file_name)
+{
+	feed_wait(feed);
+	feed->trie = trie;
+	snprintf(feed->file_name, sizeof(feed->file_name), "%s", file_name);
+	if (pthread_create(&feed->thread, NULL, feed_run, feed) != 0)
+		return -1;
+	feed->running = 1;
+	return 0;
+}
+
+// mk_bench.c includes this file with MK_NO_MAIN defined
+#ifndef MK_NO_MAIN
+// STATS: the size of the dictionary, the memory it takes and, unless
+// built with MK_NO_STATS, the latency and nodes visited of every command
+void stats_print(trie_t *trie, dat_t *snap, out_t *out)
+{
+	int n_nodes = __atomic_load_n(&trie->n_nodes, __ATOMIC_RELAXED);
+	int n_chunks = __atomic_load_n(&trie->pool.n_chunks, __ATOMIC_RELAXED);
+	size_t node_bytes = trie_node_bytes(trie);
+	out_printf(out, "keys %d nodes %d\n",
+			   __atomic_load_n(&trie->size, __ATOMIC_RELAXED), n_nodes);
+	if (snap)
+		out_printf(out, "snapshot keys %u cells %u\n", snap->header->n_keys,
+				   snap->header->n_cells);
+	pthread_rwlock_rdlock(&trie->ngram.lock);
+	size_t ngram_size = ngram_bytes(&trie->ngram);
+	pthread_rwlock_unlock(&trie->ngram.lock);
+	out_printf(out, "memory nodes %zu pool %zu index %zu snapshot %zu",
+			   node_bytes, (size_t)n_chunks * POOL_CHUNK_SIZE, ngram_size,
+			   snap ? snap->map_size : 0);
+#ifdef __GLIBC__
+	struct mallinfo2 mi = mallinfo2();
+	out_printf(out, " heap %zu", mi.uordblks + mi.hblkhd);
+#endif
+	out_printf(out, "\n");
+	// the sum of the stripes
+	cache_stripe_t sum = {0};
+	for (int i = 0; i < CACHE_STRIPES && trie->cache.capacity; i++) {
+		cache_stripe_t *stripe = &trie->cache.stripes[i];
+		pthread_mutex_lock(&stripe->lock);
+		sum.n_entries += stripe->n_entries;
+		sum.hits += stripe->hits;
+		sum.misses += stripe->misses;
+		sum.evictions += stripe->evictions;
+		sum.invalidations += stripe->invalidations;
+		pthread_mutex_unlock(&stripe->lock);
+	}
+	out_printf(out,
+			   "cache entries %d capacity %d hits %llu misses %llu"
+			   " evictions %llu invalidations %llu\n",
+			   sum.n_entries, trie->cache.capacity,
+			   (unsigned long long)sum.hits, (unsigned long long)sum.misses,
+			   (unsigned long long)sum.evictions,
+			   (unsigned long long)sum.invalidations);
+#ifndef MK_NO_STATS
+	for (int i = 0; i < STATS_N_COMMANDS; i++) {
+		stats_command_t *cmd = &stats[i];
+		uint64_t count = __atomic_load_n(&cmd->latency.count, __ATOMIC_RELAXED);
+		if (count == 0)
+			continue;
+		out_printf(out,
+				   "%s count %llu latency_ns p50 %llu p90 %llu p99 %llu max %llu",
+				   stats_names[i], (unsigned long long)count,
+				   (unsigned long long)stats_percentile(&cmd->latency, 50),
+				   (unsigned long long)stats_percentile(&cmd->latency, 90),
+				   (unsigned long long)stats_percentile(&cmd->latency, 99),
+				   (unsigned long long)__atomic_load_n(&cmd->latency.max,
+													   __ATOMIC_RELAXED));
+		out_printf(out, " nodes p50 %llu p90 %llu p99 %llu max %llu",
+				   (unsigned long long)stats_percentile(&cmd->nodes, 50),
+				   (unsigned long long)stats_percentile(&cmd->nodes, 90),
+				   (unsigned long long)stats_percentile(&cmd->nodes, 99),
+				   (unsigned long long)__atomic_load_n(&cmd->nodes.max,
+													   __ATOMIC_RELAXED));
+		pthread_mutex_lock(&stats_lock);
+		out_printf(out, " slowest %s\n", cmd->slowest);
+		pthread_mutex_unlock(&stats_lock);
+	}
+#endif
+}
+
+/*commands*/
+// everything a command can touch, shared by the stdin loop and the server
+typedef struct engine_t engine_t;
+struct engine_t {
+	trie_t *trie;
+	dat_t *snap; /* mapped snapshot, answers the queries while it is open */
+	feed_t feed;
+};
+
+void engine_init(engine_t *e)
+{
+	e->trie = trie_create(ALPHABET_SIZE, ALPHABET);
+	e->snap = NULL;
+	memset(&e->feed, 0, sizeof(e->feed));
+}
+
+void engine_free(engine_t *e)
+{
+	feed_wait(&e->feed);
+	dat_close(&e->snap);
+	trie_free(&e->trie);
+}
+
+// reads a count from 1 to INT_MAX, -1 if "s" isn't one
+int engine_count(const char *s)
+{
+	char *end;
+	errno = 0;
+	long value = strtol(s, &end, 10);
+	if (errno || end == s || *end != '\0' || value <= 0 || value > INT_MAX)
+		return -1;
+	return value;
+}
+
+/* the commands that take an argument, matched by prefix like below */
+char *engine_commands[] = {
+	"INSERT", "LOAD", "REMOVE", "FEED", "SAVE", "OPEN", "CONTAINS",
+	"AUTOCORRECT", "AUTOCOMPLETE"
+};
+
+int engine_known(const char *command)
+{
+	for (size_t i = 0; i < sizeof(engine_commands) / sizeof(char *); i++)
+		if (strncmp(command, engine_commands[i],
+					strlen(engine_commands[i])) == 0)
+			return 1;
+	return 0;
+}
+
+// runs one command line and appends its answer to "out",
+// returns 1 for EXIT
+int engine_execute(engine_t *e, char *line, out_t *out)
+{
+	char *save, *command, *arg, *extra;
+	command = strtok_r(line, " \t\r\n", &save);
+	if (!command)
+		return 0;
+	arg = strtok_r(NULL, " \t\r\n", &save);
+	extra = strtok_r(NULL, " \t\r\n", &save);
+	if (strncmp(command, "STATS", 5) == 0) {
+		stats_print(e->trie, e->snap, out);
+		return 0;
+	} else if (strncmp(command, "EXIT", 4) == 0) {
+		return 1;
+	}
+	if (!engine_known(command)) {
+		out_word(out, "Unknown command");
+		return 0;
+	}
+	if (!arg) {
+		out_word(out, "Missing argument");
+		return 0;
+	}
+	if (strncmp(command, "INSERT", 6) == 0) {
+		// an optional count: INSERT <word> <count>
+		int count = extra ? engine_count(extra) : 1;
+		if (count < 0) {
+			out_word(out, "Invalid count");
+			return 0;
+		}
+		uint64_t start = stats_begin();
+		dat_thaw(&e->snap, e->trie);
+		int ret = insertf(e->trie, arg, count);
+		if (ret == -2)
+			out_word(out, "Invalid word");
+		else if (ret != 0)
+			out_word(out, "Failed to insert word");
+		stats_end(STATS_INSERT, start, arg, count);
+	} else if (strncmp(command, "LOAD", 4) == 0) {
+		uint64_t start = stats_begin();
+		dat_thaw(&e->snap, e->trie);
+		int ret = load(e->trie, arg);
+		if (ret == -1)
+			out_word(out, "Failed to open file");
+		else if (ret != 0)
+			out_word(out, "Failed to insert every word");
+		stats_end(STATS_LOAD, start, arg, -1);
+	} else if (strncmp(command, "REMOVE", 6) == 0) {
+		uint64_t start = stats_begin();
+		dat_thaw(&e->snap, e->trie);
+		trie_remove(e->trie, arg);
+		stats_end(STATS_REMOVE, start, arg, -1);
+	} else if (strncmp(command, "FEED", 4) == 0) {
+		dat_thaw(&e->snap, e->trie);
+		if (feed_start(&e->feed, e->trie, arg) != 0)
+			out_word(out, "Failed to start feed");
+	} else if (strncmp(command, "SAVE", 4) == 0) {
+		int ret;
+		uint64_t start = stats_begin();
+		ebr_enter();
+		if (e->snap)
+			ret = dat_write_file(arg, e->snap->header, e->snap->cells);
+		else
+			ret = dat_save(e->trie, arg);
+		ebr_exit();
+		stats_end(STATS_SAVE, start, arg, -1);
+		if (ret != 0)
+			out_word(out, "Failed to save file");
+	} else if (strncmp(command, "OPEN", 4) == 0) {
+		uint64_t start = stats_begin();
+		dat_t *opened = dat_open(arg, e->trie);
+		if (!opened) {
+			out_word(out, "Failed to open file");
+			return 0;
+		}
+		feed_wait(&e->feed);
+		dat_close(&e->snap);
+		trie_free(&e->trie);
+		e->trie = trie_create(ALPHABET_SIZE, ALPHABET);
+		e->snap = opened;
+		stats_end(STATS_OPEN, start, arg, -1);
+	} else if (strncmp(command, "CONTAINS", 8) == 0) {
+		// CONTAINS <fragment> [n], the snapshot has no substring index and
+		// thawing it would give up the shared mapping
+		int n = extra ? engine_count(extra) : CONTAINS_DEFAULT;
+		if (n < 0) {
+			out_word(out, "Invalid count");
+			return 0;
+		}
+		if (e->snap) {
+			out_word(out, "Not available on a snapshot");
+			return 0;
+		}
+		uint64_t start = stats_begin();
+		ebr_enter();
+		if (contains(e->trie, arg, n, out) != 0)
+			out_word(out, "Out of memory");
+		ebr_exit();
+		stats_end(STATS_CONTAINS, start, arg, n);
+	} else if (strncmp(command, "AUTOCORRECT", 11) == 0 ||
+			   strncmp(command, "AUTOCOMPLETE", 12) == 0) {
+		if (!extra) {
+			out_word(out, "Missing argument");
+			return 0;
+		}
+		int k = atoi(extra);
+		int correct = strncmp(command, "AUTOCORRECT", 11) == 0;
+		int type = correct ? CACHE_AUTOCORRECT : CACHE_AUTOCOMPLETE;
+		uint64_t start = stats_begin(), version;
+		size_t from = out->len;
+		ebr_enter();
+		if (!cache_get(&e->trie->cache, type, arg, k, out, &version)) {
+			if (correct && e->snap)
+				dat_autocorrect(e->snap, arg, k, out);
+			else if (correct)
+				autoccorect_node(e->trie, e->trie->root, arg, k, out);
+			else if (e->snap)
+				dat_autocomplete(e->snap, arg, k, out);
+			else
+				autocomplete(e->trie, e->trie->root, arg, k, out);
+			cache_put(&e->trie->cache, type, arg, k, out->data + from,
+					  out->len - from, version);
+		}
+		ebr_exit();
+		stats_end(correct ? STATS_AUTOCORRECT : STATS_AUTOCOMPLETE, start, arg,
+				  k);
+	}
+	return 0;
+}
+
+/*socket server*/
+// mk -s <path> answers the same commands on a local socket, one command per
+// line. The answer to every command ends with an empty line; the words never
+// are empty so the client can split the answers. The lines are run as they
+// are read and the answers of a whole read are sent in one write.
+#define SERVER_MAX_LINE (1 << 20)	 /* longer lines close the connection */
+#define SERVER_MAX_PENDING (4 << 20) /* stop reading while more is unsent */
+#define SERVER_MAX_EVENTS 64
+#define SERVER_PAUSE_MS 100 /* accepting again after running out of fds */
+
+typedef struct conn_t conn_t;
+struct conn_t {
+	int fd;
+	char *in;
+	size_t in_len;
+	size_t in_capacity;
+	out_t out;
+	size_t sent;
+	int exited; /* EXIT was read, the lines after it are ignored */
+	int eof;
+};
+
+volatile sig_atomic_t server_stop;
+
+void server_signal(int sig)
+{
+	(void)sig;
+	server_stop = 1;
+}
+
+void conn_close(int epfd, conn_t *conn)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out.data);
+	free(conn);
+}
+
+// runs the complete lines in the input buffer
+void conn_execute(engine_t *e, conn_t *conn)
+{
+	size_t pos = 0;
+	char *eol;
+	while (!conn->exited &&
+		   (eol = memchr(conn->in + pos, '\n', conn->in_len - pos))) {
+		*eol = '\0';
+		if (engine_execute(e, conn->in + pos, &conn->out) == 1)
+			conn->exited = 1;
+		out_word(&conn->out, "");
+		pos = eol + 1 - conn->in;
+	}
+	memmove(conn->in, conn->in + pos, conn->in_len - pos);
+	conn->in_len -= pos;
+}
+
+// returns -1 if the connection failed
+int conn_flush(conn_t *conn)
+{
+	while (conn->sent < conn->out.len) {
+		ssize_t n = write(conn->fd, conn->out.data + conn->sent,
+						  conn->out.len - conn->sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		conn->sent += n;
+	}
+	conn->out.len = conn->sent = 0;
+	return 0;
+}
+
+// reads and runs the lines until the answers pile up, returns -1 if the
+// connection failed or a line is too long
+int conn_read(engine_t *e, conn_t *conn)
+{
+	while (!conn->exited && conn->out.len - conn->sent < SERVER_MAX_PENDING) {
+		if (conn->in_capacity - conn->in_len < 4096) {
+			// only the unfinished line is left in the buffer
+			if (conn->in_len > SERVER_MAX_LINE)
+				return -1;
+			conn->in_capacity = conn->in_capacity ? 2 * conn->in_capacity
+												  : 16384;
+			conn->in = realloc(conn->in, conn->in_capacity);
+		}
+		ssize_t n = read(conn->fd, conn->in + conn->in_len,
+						 conn->in_capacity - conn->in_len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		if (n == 0) {
+			// a last line without newline still is a command
+			if (conn->in_len && conn->in[conn->in_len - 1] != '\n')
+				conn->in[conn->in_len++] = '\n';
+			conn->eof = 1;
+			return 0;
+		}
+		conn->in_len += n;
+		conn_execute(e, conn);
+	}
+	return 0;
+}
+
+// handles an event on a connection, returns -1 once it is closed
+int conn_event(int epfd, engine_t *e, conn_t *conn, uint32_t events)
+{
+	if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+		conn_close(epfd, conn);
+		return -1;
+	}
+	if (!conn->eof && !conn->exited && (events & EPOLLIN) &&
+		conn_read(e, conn) != 0) {
+		conn_close(epfd, conn);
+		return -1;
+	}
+	conn_execute(e, conn);
+	int closing = conn->eof || conn->exited;
+	if (conn_flush(conn) != 0) {
+		conn_close(epfd, conn);
+		return -1;
+	}
+	int pending = conn->out.len > conn->sent;
+	if (!pending && closing) {
+		conn_close(epfd, conn);
+		return -1;
+	}
+	struct epoll_event ev = {.data.ptr = conn};
+	if (pending)
+		ev.events |= EPOLLOUT;
+	if (!closing && conn->out.len - conn->sent < SERVER_MAX_PENDING)
+		ev.events |= EPOLLIN;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+		conn_close(epfd, conn);
+		return -1;
+	}
+	return 0;
+}
+
+int server_listen(char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	// only a stale socket is replaced, never another kind of file
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s: Not a socket\n", path);
+			close(fd);
+			return -1;
+		}
+		unlink(path);
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		listen(fd, SOMAXCONN) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// the commands run one at a time on the event loop thread, so they see
+// the engine exactly as they do on stdin
+int server_run(char *path)
+{
+	int lfd = server_listen(path);
+	if (lfd < 0)
+		return 1;
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) != 0) {
+		perror("epoll");
+		if (epfd >= 0)
+			close(epfd);
+		close(lfd);
+		unlink(path);
+		return 1;
+	}
+	struct sigaction sa = {.sa_handler = server_signal};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	engine_t e;
+	engine_init(&e);
+	/* connections are only reachable through epoll, kept to free them */
+	conn_t **conns = NULL;
+	int n_conns = 0;
+	/* out of descriptors, the listening socket waits for a close or for
+	 * SERVER_PAUSE_MS */
+	int paused = 0;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	while (!server_stop) {
+		int n = epoll_wait(epfd, events, SERVER_MAX_EVENTS,
+						   paused ? SERVER_PAUSE_MS : -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("epoll_wait");
+			break;
+		}
+		ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = NULL};
+		if (paused && n == 0 && epoll_ctl(epfd, EPOLL_CTL_MOD, lfd, &ev) == 0)
+			paused = 0;
+		for (int i = 0; i < n; i++) {
+			conn_t *conn = events[i].data.ptr;
+			if (conn) {
+				if (conn_event(epfd, &e, conn, events[i].events) == 0)
+					continue;
+				for (int j = 0; j < n_conns; j++)
+					if (conns[j] == conn) {
+						conns[j] = conns[--n_conns];
+						break;
+					}
+				ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = NULL};
+				if (paused && epoll_ctl(epfd, EPOLL_CTL_MOD, lfd, &ev) == 0)
+					paused = 0;
+				continue;
+			}
+			int fd;
+			while ((fd = accept4(lfd, NULL, NULL,
+								 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				conn = calloc(1, sizeof(conn_t));
+				conn->fd = fd;
+				ev.events = EPOLLIN;
+				ev.data.ptr = conn;
+				if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+					close(fd);
+					free(conn);
+					continue;
+				}
+				conns = realloc(conns, (n_conns + 1) * sizeof(conn_t *));
+				conns[n_conns++] = conn;
+			}
+			// the pending connection stays readable under level triggered
+			// epoll, it isn't watched until a connection is closed
+			if (errno == EMFILE || errno == ENFILE) {
+				ev = (struct epoll_event){.events = 0, .data.ptr = NULL};
+				paused = epoll_ctl(epfd, EPOLL_CTL_MOD, lfd, &ev) == 0;
+			}
+		}
+	}
+	for (int i = 0; i < n_conns; i++)
+		conn_close(epfd, conns[i]);
+	free(conns);
+	close(epfd);
+	close(lfd);
+	unlink(path);
+	engine_free(&e);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *socket_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+		if (opt == 's') {
+			socket_path = optarg;
+		} else if (opt == 'c') {
+			cache_capacity = atoi(optarg);
+		} else {
+			fprintf(stderr, "usage: %s [-s socket] [-c cache entries]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (socket_path)
+		return server_run(socket_path);
+	engine_t e;
+	engine_init(&e);
+	out_t out = {0};
+	char *line = NULL;
+	size_t capacity = 0;
+	while (getline(&line, &capacity, stdin) != -1) {
+		int done = engine_execute(&e, line, &out);
+		if (out.len)
+			fwrite(out.data, 1, out.len, stdout);
+		out.len = 0;
+		if (done)
+			break;
 	}
+	engine_free(&e);
+	free(line);
+	free(out.data);
 	return 0;
 }
+#endif
@@ -0,0 +1,491 @@
+/* Benchmark for the trie of mk.c, it includes mk.c so that it times the
+ * same code. Build and run with
+ *	gcc -O2 -pthread -o mk_bench mk_bench.c -lm
+ *	./mk_bench -v 100000 -n 1000000 -q 100000 > report.jsonl
+ * Every line of the report is a JSON object, the words found by the
+ * queries are dropped. With -g <file> only the corpus is written.
+ * Built with -fsanitize=thread or address, "-t 4" is a stress run of the
+ * readers against a writer.
+ */
+#define MK_NO_MAIN
+#include "mk.c"
+
+#include <getopt.h>
+#include <malloc.h>
+#include <math.h>
+#include <time.h>
+
+#define BENCH_MIN_LEN 3
+#define BENCH_MAX_LEN 12
+/* the letters of the generated words, printable ones for a byte alphabet */
+#if ALPHABET_SIZE == 256
+#define BENCH_LETTERS "abcdefghijklmnopqrstuvwxyz0123456789"
+#else
+#define BENCH_LETTERS ALPHABET
+#endif
+
+typedef struct bench_t bench_t;
+struct bench_t {
+	/* distinct words, occurrences in the corpus and queries per operation */
+	int n_vocab;
+	int n_words;
+	int n_queries;
+	/* exponent of the Zipf distribution of the words */
+	double zipf;
+	int n_threads;
+	uint64_t rng;
+
+	/* the vocabulary, by decreasing popularity */
+	char **vocab;
+	/* cumulative Zipf weights of the vocabulary */
+	double *cdf;
+
+	uint64_t *latencies;
+	/* answers of the queries, emptied after each of them */
+	out_t out;
+	FILE *report;
+};
+
+// xorshift64*
+uint64_t bench_rand(bench_t *b)
+{
+	b->rng ^= b->rng >> 12;
+	b->rng ^= b->rng << 25;
+	b->rng ^= b->rng >> 27;
+	return b->rng * 2685821657736338717ULL;
+}
+
+double bench_uniform(bench_t *b)
+{
+	return (bench_rand(b) >> 11) * 0x1.0p-53;
+}
+
+uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// bytes the allocator has handed out, including the mmap-ed blocks
+size_t bench_heap_bytes(void)
+{
+#ifdef __GLIBC__
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+// a random word of BENCH_MIN_LEN to BENCH_MAX_LEN letters
+char *bench_random_word(bench_t *b)
+{
+	int len = BENCH_MIN_LEN +
+			  bench_rand(b) % (BENCH_MAX_LEN - BENCH_MIN_LEN + 1);
+	char *word = malloc(len + 1);
+	for (int i = 0; i < len; i++)
+		word[i] = BENCH_LETTERS[bench_rand(b) % (sizeof(BENCH_LETTERS) - 1)];
+	word[len] = '\0';
+	return word;
+}
+
+void bench_create_vocab(bench_t *b)
+{
+	b->vocab = malloc(b->n_vocab * sizeof(*b->vocab));
+	b->cdf = malloc(b->n_vocab * sizeof(*b->cdf));
+	double sum = 0;
+	for (int i = 0; i < b->n_vocab; i++) {
+		b->vocab[i] = bench_random_word(b);
+		sum += 1 / pow(i + 1, b->zipf);
+		b->cdf[i] = sum;
+	}
+}
+
+// a word of the vocabulary, drawn with its Zipf probability
+char *bench_zipf_word(bench_t *b)
+{
+	double u = bench_uniform(b) * b->cdf[b->n_vocab - 1];
+	int lo = 0, hi = b->n_vocab - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (b->cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return b->vocab[lo];
+}
+
+// writes n_words words drawn from the vocabulary, one per line
+int bench_write_corpus(bench_t *b, FILE *file)
+{
+	for (int i = 0; i < b->n_words; i++)
+		if (fprintf(file, "%s\n", bench_zipf_word(b)) < 0)
+			return -1;
+	return 0;
+}
+
+// the query mix: a popular word, cut to a prefix of at least 2 letters
+// when "prefix" is set or with one letter replaced when "typo" is set
+void bench_query(bench_t *b, char *buf, int prefix, int typo)
+{
+	char *word = bench_zipf_word(b);
+	int len = strlen(word);
+	memcpy(buf, word, len + 1);
+	if (prefix)
+		buf[2 + bench_rand(b) % (len - 1)] = '\0';
+	if (typo)
+		buf[bench_rand(b) % len] =
+			BENCH_LETTERS[bench_rand(b) % (sizeof(BENCH_LETTERS) - 1)];
+}
+
+int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// writes the throughput and the latency percentiles of n operations
+void bench_report(bench_t *b, const char *op, int n, uint64_t total_ns)
+{
+	qsort(b->latencies, n, sizeof(*b->latencies), bench_cmp);
+	fprintf(b->report,
+			"{\"op\":\"%s\",\"ops\":%d,\"ops_per_sec\":%.0f,"
+			"\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+			op, n, total_ns ? n * 1e9 / total_ns : 0.0,
+			(unsigned long long)b->latencies[n / 2],
+			(unsigned long long)b->latencies[(int)(n * 0.99)]);
+	fflush(b->report);
+}
+
+void bench_load(bench_t *b, trie_t *trie)
+{
+	char file_name[] = "/tmp/mk_bench_XXXXXX";
+	int fd = mkstemp(file_name);
+	FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!file || bench_write_corpus(b, file) < 0 || fclose(file) != 0) {
+		fprintf(stderr, "Error: Failed to write the corpus!\n");
+		exit(EXIT_FAILURE);
+	}
+	size_t heap = bench_heap_bytes();
+	uint64_t start = bench_now();
+	if (load(trie, file_name) != 0) {
+		fprintf(stderr, "Error: Failed to load the corpus!\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t total = bench_now() - start;
+	heap = bench_heap_bytes() - heap;
+	unlink(file_name);
+
+	fprintf(b->report,
+			"{\"op\":\"load\",\"words\":%d,\"seconds\":%.6f,"
+			"\"words_per_sec\":%.0f}\n",
+			b->n_words, total / 1e9, b->n_words * 1e9 / total);
+	// what the nodes and the pool should take, against what the
+	// allocator reports
+	size_t node_bytes = trie_node_bytes(trie);
+	size_t pool_bytes = (size_t)trie->pool.n_chunks * POOL_CHUNK_SIZE;
+	fprintf(b->report,
+			"{\"op\":\"memory\",\"keys\":%d,\"nodes\":%d,"
+			"\"node_bytes\":%zu,\"pool_bytes\":%zu,\"heap_bytes\":%zu,"
+			"\"bytes_per_key\":%.1f,\"heap_bytes_per_key\":%.1f}\n",
+			trie->size, trie->n_nodes, node_bytes, pool_bytes, heap,
+			trie->size ? (double)(node_bytes + pool_bytes) / trie->size : 0,
+			trie->size ? (double)heap / trie->size : 0);
+	fflush(b->report);
+}
+
+void bench_insert(bench_t *b, trie_t *trie)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < b->n_queries; i++) {
+		char *word = bench_zipf_word(b);
+		uint64_t start = bench_now();
+		insertf(trie, word, 1);
+		b->latencies[i] = bench_now() - start;
+		total += b->latencies[i];
+	}
+	bench_report(b, "insertf", b->n_queries, total);
+}
+
+// half of the searched words are misspelled, most of them miss
+void bench_search(bench_t *b, trie_t *trie)
+{
+	char buf[BENCH_MAX_LEN + 1];
+	uint64_t total = 0;
+	for (int i = 0; i < b->n_queries; i++) {
+		bench_query(b, buf, 0, i & 1);
+		uint64_t start = bench_now();
+		ebr_enter();
+		trie_search(trie, buf);
+		ebr_exit();
+		b->latencies[i] = bench_now() - start;
+		total += b->latencies[i];
+	}
+	bench_report(b, "trie_search", b->n_queries, total);
+}
+
+void bench_autocomplete(bench_t *b, trie_t *trie, int no_c)
+{
+	char buf[BENCH_MAX_LEN + 1], op[32];
+	uint64_t total = 0;
+	for (int i = 0; i < b->n_queries; i++) {
+		bench_query(b, buf, 1, 0);
+		uint64_t start = bench_now();
+		ebr_enter();
+		autocomplete(trie, trie->root, buf, no_c, &b->out);
+		ebr_exit();
+		b->out.len = 0;
+		b->latencies[i] = bench_now() - start;
+		total += b->latencies[i];
+	}
+	sprintf(op, "autocomplete%d", no_c);
+	bench_report(b, op, b->n_queries, total);
+}
+
+void bench_autocorrect(bench_t *b, trie_t *trie, int k)
+{
+	char buf[BENCH_MAX_LEN + 1], op[32];
+	uint64_t total = 0;
+	for (int i = 0; i < b->n_queries; i++) {
+		bench_query(b, buf, 0, 1);
+		uint64_t start = bench_now();
+		ebr_enter();
+		autoccorect_node(trie, trie->root, buf, k, &b->out);
+		ebr_exit();
+		b->out.len = 0;
+		b->latencies[i] = bench_now() - start;
+		total += b->latencies[i];
+	}
+	sprintf(op, "autocorrect_k%d", k);
+	bench_report(b, op, b->n_queries, total);
+}
+
+typedef struct bench_reader_t bench_reader_t;
+struct bench_reader_t {
+	pthread_t thread;
+	trie_t *trie;
+	/* prefixes and misspelled words, run as AUTOCOMPLETE and AUTOCORRECT */
+	char **queries;
+	int n_queries;
+	out_t out;
+};
+
+void *bench_reader(void *aux)
+{
+	bench_reader_t *reader = (bench_reader_t *)aux;
+	for (int i = 0; i < reader->n_queries; i++) {
+		ebr_enter();
+		if (i & 1)
+			autoccorect_node(reader->trie, reader->trie->root,
+							 reader->queries[i], 1, &reader->out);
+		else
+			autocomplete(reader->trie, reader->trie->root, reader->queries[i],
+						 1 + i / 2 % 3, &reader->out);
+		ebr_exit();
+		reader->out.len = 0;
+	}
+	ebr_unregister();
+	return NULL;
+}
+
+typedef struct bench_writer_t bench_writer_t;
+struct bench_writer_t {
+	pthread_t thread;
+	trie_t *trie;
+	char **words;
+	int n_words;
+	/* set once the readers are done */
+	int stop;
+	int ops;
+};
+
+// inserts the words and removes the ones inserted half a round before,
+// some of them popular words the readers look for
+void *bench_writer(void *aux)
+{
+	bench_writer_t *writer = (bench_writer_t *)aux;
+	int n = writer->n_words;
+	for (int i = 0; !__atomic_load_n(&writer->stop, __ATOMIC_RELAXED);
+		 i = (i + 1) % n) {
+		insertf(writer->trie, writer->words[i], 1);
+		trie_remove(writer->trie, writer->words[(i + n / 2) % n]);
+		writer->ops += 2;
+	}
+	return NULL;
+}
+
+// total query throughput of 1, 2, 4 ... n_threads readers, each of them
+// running the whole query set, alone and while a writer inserts and
+// removes words
+void bench_readers(bench_t *b, trie_t *trie)
+{
+	char **queries = malloc(b->n_queries * sizeof(*queries));
+	for (int i = 0; i < b->n_queries; i++) {
+		queries[i] = malloc(BENCH_MAX_LEN + 1);
+		bench_query(b, queries[i], !(i & 1), i & 1);
+	}
+	bench_writer_t writer = {0, trie, NULL, b->n_queries, 0, 0};
+	writer.words = malloc(writer.n_words * sizeof(char *));
+	for (int i = 0; i < writer.n_words; i++)
+		writer.words[i] = i & 1 ? bench_random_word(b)
+								: strdup(bench_zipf_word(b));
+	bench_reader_t *readers = calloc(b->n_threads, sizeof(*readers));
+	for (int n = 1;; n = 2 * n < b->n_threads ? 2 * n : b->n_threads) {
+		for (int with_writer = 0; with_writer <= 1; with_writer++) {
+			writer.stop = writer.ops = 0;
+			if (with_writer)
+				pthread_create(&writer.thread, NULL, bench_writer, &writer);
+			uint64_t start = bench_now();
+			for (int i = 0; i < n; i++) {
+				readers[i].trie = trie;
+				readers[i].queries = queries;
+				readers[i].n_queries = b->n_queries;
+				pthread_create(&readers[i].thread, NULL, bench_reader,
+							   &readers[i]);
+			}
+			for (int i = 0; i < n; i++)
+				pthread_join(readers[i].thread, NULL);
+			uint64_t total = bench_now() - start;
+			if (with_writer) {
+				__atomic_store_n(&writer.stop, 1, __ATOMIC_RELAXED);
+				pthread_join(writer.thread, NULL);
+				// back to the vocabulary for the next phases
+				for (int i = 0; i < writer.n_words; i++)
+					if (i & 1)
+						trie_remove(trie, writer.words[i]);
+					else
+						insertf(trie, writer.words[i], 1);
+			}
+			fprintf(b->report,
+					"{\"op\":\"query_threads\",\"threads\":%d,"
+					"\"writer_ops\":%d,\"ops\":%d,\"ops_per_sec\":%.0f}\n",
+					n, writer.ops, n * b->n_queries,
+					(double)n * b->n_queries * 1e9 / total);
+			fflush(b->report);
+		}
+		if (n == b->n_threads)
+			break;
+	}
+	for (int i = 0; i < b->n_threads; i++)
+		free(readers[i].out.data);
+	free(readers);
+	for (int i = 0; i < writer.n_words; i++)
+		free(writer.words[i]);
+	free(writer.words);
+	for (int i = 0; i < b->n_queries; i++)
+		free(queries[i]);
+	free(queries);
+}
+
+// removes distinct words of the vocabulary, the most popular ones first
+void bench_remove(bench_t *b, trie_t *trie)
+{
+	int n = b->n_queries < b->n_vocab ? b->n_queries : b->n_vocab;
+	uint64_t total = 0;
+	for (int i = 0; i < n; i++) {
+		uint64_t start = bench_now();
+		trie_remove(trie, b->vocab[i]);
+		b->latencies[i] = bench_now() - start;
+		total += b->latencies[i];
+	}
+	bench_report(b, "trie_remove", n, total);
+}
+
+// inserts and removes new words, the pool has to reuse their space
+void bench_churn(bench_t *b, trie_t *trie)
+{
+	size_t pool_before = (size_t)trie->pool.n_chunks * POOL_CHUNK_SIZE;
+	uint64_t total = 0;
+	for (int i = 0; i < b->n_queries; i++) {
+		char *word = bench_random_word(b);
+		uint64_t start = bench_now();
+		insertf(trie, word, 1);
+		trie_remove(trie, word);
+		b->latencies[i] = bench_now() - start;
+		total += b->latencies[i];
+		free(word);
+	}
+	bench_report(b, "churn", b->n_queries, total);
+	fprintf(b->report,
+			"{\"op\":\"churn_memory\",\"pool_bytes_before\":%zu,"
+			"\"pool_bytes_after\":%zu}\n",
+			pool_before, (size_t)trie->pool.n_chunks * POOL_CHUNK_SIZE);
+	fflush(b->report);
+}
+
+void bench_usage(char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [-v vocabulary] [-n corpus words] [-q queries]\n"
+			"          [-s zipf exponent] [-t threads] [-r seed]"
+			" [-g corpus file]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	bench_t b = {.n_vocab = 100000, .n_words = 1000000, .n_queries = 100000,
+				 .zipf = 1.0, .n_threads = 1, .rng = 42};
+	char *corpus = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "v:n:q:s:t:r:g:")) != -1) {
+		if (opt == 'v')
+			b.n_vocab = atoi(optarg);
+		else if (opt == 'n')
+			b.n_words = atoi(optarg);
+		else if (opt == 'q')
+			b.n_queries = atoi(optarg);
+		else if (opt == 's')
+			b.zipf = atof(optarg);
+		else if (opt == 't')
+			b.n_threads = atoi(optarg);
+		else if (opt == 'r')
+			b.rng = strtoull(optarg, NULL, 10) | 1;
+		else if (opt == 'g')
+			corpus = optarg;
+		else {
+			bench_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (b.n_vocab < 1 || b.n_words < 1 || b.n_queries < 1 ||
+		b.n_threads < 1) {
+		bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	bench_create_vocab(&b);
+
+	if (corpus) {
+		FILE *file = fopen(corpus, "w");
+		if (!file || bench_write_corpus(&b, file) < 0 || fclose(file) != 0) {
+			fprintf(stderr, "Error: Failed to write %s!\n", corpus);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	b.report = stdout;
+	b.latencies = malloc(b.n_queries * sizeof(*b.latencies));
+
+	trie_t *trie = trie_create(ALPHABET_SIZE, ALPHABET);
+	bench_load(&b, trie);
+	bench_insert(&b, trie);
+	bench_search(&b, trie);
+	for (int no_c = 1; no_c <= 3; no_c++)
+		bench_autocomplete(&b, trie, no_c);
+	for (int k = 0; k <= 2; k++)
+		bench_autocorrect(&b, trie, k);
+	bench_readers(&b, trie);
+	bench_remove(&b, trie);
+	bench_churn(&b, trie);
+	trie_free(&trie);
+
+	for (int i = 0; i < b.n_vocab; i++)
+		free(b.vocab[i]);
+	free(b.vocab);
+	free(b.cdf);
+	free(b.latencies);
+	free(b.out.data);
+	return EXIT_SUCCESS;
+}